@@ -4,9 +4,18 @@
 #include <opencv2/calib3d.hpp>
 #include <opencv2/imgproc.hpp>
 #include <gtk/gtk.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
-#include <ctime>
+#include <cmath>
+#include <climits>
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <new>
 
 using namespace std;
 using namespace cv;
@@ -16,6 +25,84 @@ typedef enum {
 	BM, SGBM
 } MatcherType;
 
+/* Disparity export formats */
+typedef enum {
+	EXPORT_PNG, EXPORT_RAW, EXPORT_COMPRESSED
+} ExportFormat;
+
+struct DatasetEvaluator;
+struct DisparityExporter;
+struct SequenceTimeline;
+
+/* Runtime prediction */
+
+/* What the runtime depends on, for one set of parameters */
+struct RuntimeFeatures {
+	int bucket; /* Algorithm, SGBM mode and hierarchical mode, fitted separately */
+	double area;
+	int num_disparities;
+	int block_size;
+	int threads;
+};
+
+/* Fits runtime = a + b*work + c*work*block_size on the observed timings of
+ * each bucket, where work = area*num_disparities/threads. Only the most
+ * recent MAX_SAMPLES timings of each bucket are kept. */
+struct RuntimeModel {
+	struct Sample {
+		double work;
+		double block_size;
+		double runtime; /* Milliseconds */
+	};
+
+	vector<vector<Sample> > buckets;
+
+	static const size_t MAX_SAMPLES = 256;
+};
+
+/* Allocation instrumentation */
+
+/* Allocations made by one thread since it started, only counted with
+ * -instrument. Mat buffers are counted by CountingAllocator, everything
+ * else going through operator new by its replacement. */
+struct AllocationCounters {
+	gsize mat_allocations;
+	gsize mat_bytes;
+	gsize heap_allocations;
+	gsize heap_bytes;
+};
+
+/* Undistortion and rectification of a calibrated stereo pair */
+struct Rectification {
+	Mat map11, map12, map21, map22;
+	Mat q; /* Disparity-to-depth matrix */
+	Rect roi1, roi2;
+};
+
+/* Values of all the parameters, with the fields of SESSION_PARAMETERS in its order */
+struct ParameterValues {
+	MatcherType matcher_type;
+	vector<int> values;
+};
+
+/* One stereo pair of a multi-camera rig, with its own images, calibration and matcher */
+struct RigPair {
+	string name;
+	Mat left_image, right_image; /* Rectified color images, for display */
+	Mat left, right; /* Rectified grayscale images, for matching */
+	bool calibrated;
+	Rectification rectification;
+	ParameterValues parameters; /* The shared ones, except for those overridden */
+	bool matcher_type_overridden;
+	vector<bool> overridden; /* In the order of SESSION_PARAMETERS */
+	Ptr<StereoMatcher> matcher;
+	Mat disparity;
+	double elapsed; /* Milliseconds */
+	GThread *thread; /* Matching the pair, kept here so that matching the rig allocates nothing */
+	AllocationCounters allocations_before, allocations_after; /* Of the thread matching it */
+	GtkLabel *label; /* Page of the pair on the notebook */
+};
+
 /* Main data structure definition */
 struct ChData {
 	/* Widgets */
@@ -28,18 +115,25 @@ struct ChData {
 		*sc_disp_max_diff, *sc_speckle_range, *sc_speckle_window_size,
 		*sc_p1, *sc_p2, *sc_pre_filter_cap, *sc_pre_filter_size,
 		*sc_uniqueness_ratio, *sc_texture_threshold,
-		*rb_pre_filter_normalized, *rb_pre_filter_xsobel, *chk_full_dp;
+		*rb_pre_filter_normalized, *rb_pre_filter_xsobel, *chk_full_dp,
+		*chk_hierarchical, *sc_band_height, *sc_band_margin;
 	GtkAdjustment *adj_block_size, *adj_min_disparity, *adj_num_disparities,
 	*adj_disp_max_diff, *adj_speckle_range, *adj_speckle_window_size,
 	*adj_p1, *adj_p2, *adj_pre_filter_cap, *adj_pre_filter_size,
-	*adj_uniqueness_ratio, *adj_texture_threshold;
+	*adj_uniqueness_ratio, *adj_texture_threshold, *adj_band_height, *adj_band_margin;
 	GtkWidget *status_bar;
 	gint status_bar_context;
+	GtkLabel *lbl_dataset;
+	GtkWidget *box_timeline;
+	GtkAdjustment *adj_frame;
+	GtkLabel *lbl_cache;
+	gint message_status_context;
 
 	/* OpenCV */
 	Ptr<StereoMatcher> stereo_matcher;
 	Mat cv_image_left, cv_image_right, cv_image_disparity,
-			cv_image_disparity_normalized, cv_color_image;
+			cv_image_disparity_normalized, cv_color_image,
+			cv_left_rgb, cv_right_rgb;
 	MatcherType matcher_type;
 	int block_size;
 	int disp_12_max_diff;
@@ -55,11 +149,52 @@ struct ChData {
 	int p1;
 	int p2;
 	int mode;
+	int hierarchical;
+	int band_height;
+	int band_margin;
 
 	Rect *roi1, *roi2;
+	Mat q; /* Disparity-to-depth matrix, empty without calibration files */
+	Mat map11, map12, map21, map22; /* Rectification maps, empty without calibration files */
 
 	bool live_update;
 
+	/* Dataset evaluated in the background, NULL if none was given */
+	DatasetEvaluator *dataset;
+
+	/* Session recording, session_log is NULL if not recording */
+	FILE *session_log;
+	gint64 session_start;
+	MatcherType session_matcher_type;
+	vector<int> session_values; /* Last recorded values, empty before the first step */
+
+	/* Disparity export, export_directory is NULL unless every computation is exported */
+	DisparityExporter *exporter;
+	char *export_directory;
+	ExportFormat export_format;
+	int export_count;
+
+	/* Runtime prediction, limits are disabled when 0 */
+	RuntimeModel runtime_model;
+	double frame_budget; /* Milliseconds */
+	double max_runtime; /* Seconds */
+	ParameterValues computed_parameters; /* Values of the disparity shown, none before the first computation, unused with a rig */
+
+	/* Sequence shown on the timeline, NULL if none was given */
+	SequenceTimeline *timeline;
+	int current_frame;
+
+	/* Pairs of a multi-camera rig, empty if no rig was given. The images,
+	 * maps, ROIs and parameters above are those of the selected pair. */
+	vector<RigPair> rig;
+	int rig_pair;
+	ParameterValues rig_shared; /* Values of the parameters not overridden */
+	GtkNotebook *nb_rig;
+
+	/* Allocation instrumentation, enabled with -instrument */
+	bool instrument;
+	long previous_rss; /* Kilobytes after the previous update, 0 before the first one */
+
 	/* Defalt values */
 	static const int DEFAULT_BLOCK_SIZE = 5;
 	static const int DEFAULT_DISP_12_MAX_DIFF = -1;
@@ -76,6 +211,9 @@ struct ChData {
 	static const int DEFAULT_P1 = 0;
 	static const int DEFAULT_P2 = 0;
 	static const int DEFAULT_MODE = StereoSGBM::MODE_SGBM;
+	static const int DEFAULT_HIERARCHICAL = 0;
+	static const int DEFAULT_BAND_HEIGHT = 64;
+	static const int DEFAULT_BAND_MARGIN = 4;
 
 	ChData() : matcher_type(BM), block_size(DEFAULT_BLOCK_SIZE), disp_12_max_diff(DEFAULT_DISP_12_MAX_DIFF), min_disparity(DEFAULT_MIN_DISPARITY),
 			num_disparities(DEFAULT_NUM_DISPARITIES), speckle_range(DEFAULT_SPECKLE_RANGE),
@@ -83,163 +221,3079 @@ struct ChData {
 			pre_filter_size(DEFAULT_PRE_FILTER_SIZE), pre_filter_type(DEFAULT_PRE_FILTER_TYPE),
 			texture_threshold(DEFAULT_TEXTURE_THRESHOLD),
 			uniqueness_ratio(DEFAULT_UNIQUENESS_RATIO), p1(DEFAULT_P1), p2(DEFAULT_P2),
-			mode(DEFAULT_MODE), roi1(NULL), roi2(NULL), live_update(true)
+			mode(DEFAULT_MODE), hierarchical(DEFAULT_HIERARCHICAL),
+			band_height(DEFAULT_BAND_HEIGHT), band_margin(DEFAULT_BAND_MARGIN), roi1(NULL), roi2(NULL), live_update(true),
+			dataset(NULL), session_log(NULL), session_start(0), session_matcher_type(BM),
+			exporter(NULL), export_directory(NULL), export_format(EXPORT_PNG), export_count(0),
+			frame_budget(0), max_runtime(0), timeline(NULL), current_frame(0),
+			rig_pair(0), nb_rig(NULL), instrument(false), previous_rss(0)
 		{}
 };
 
-void update_matcher(ChData *data) {
-	if(!data->live_update) {
+/* Copies the parameters of a BM or SGBM matcher into another one of the same type */
+void copy_matcher_parameters(const Ptr<StereoMatcher> &from, const Ptr<StereoMatcher> &to) {
+	to->setBlockSize(from->getBlockSize());
+	to->setDisp12MaxDiff(from->getDisp12MaxDiff());
+	to->setMinDisparity(from->getMinDisparity());
+	to->setNumDisparities(from->getNumDisparities());
+	to->setSpeckleRange(from->getSpeckleRange());
+	to->setSpeckleWindowSize(from->getSpeckleWindowSize());
+
+	Ptr<StereoBM> from_bm = from.dynamicCast<StereoBM>(), to_bm = to.dynamicCast<StereoBM>();
+
+	if(from_bm && to_bm) {
+		to_bm->setPreFilterCap(from_bm->getPreFilterCap());
+		to_bm->setPreFilterSize(from_bm->getPreFilterSize());
+		to_bm->setPreFilterType(from_bm->getPreFilterType());
+		to_bm->setTextureThreshold(from_bm->getTextureThreshold());
+		to_bm->setUniquenessRatio(from_bm->getUniquenessRatio());
+	}
+
+	Ptr<StereoSGBM> from_sgbm = from.dynamicCast<StereoSGBM>(), to_sgbm = to.dynamicCast<StereoSGBM>();
+
+	if(from_sgbm && to_sgbm) {
+		to_sgbm->setMode(from_sgbm->getMode());
+		to_sgbm->setP1(from_sgbm->getP1());
+		to_sgbm->setP2(from_sgbm->getP2());
+		to_sgbm->setPreFilterCap(from_sgbm->getPreFilterCap());
+		to_sgbm->setUniquenessRatio(from_sgbm->getUniquenessRatio());
+	}
+}
+
+/* Creates a matcher of the same type with the same parameters */
+Ptr<StereoMatcher> copy_matcher(const Ptr<StereoMatcher> &matcher) {
+	Ptr<StereoMatcher> copy;
+
+	if(matcher.dynamicCast<StereoBM>()) {
+		copy = StereoBM::create();
+	} else {
+		copy = StereoSGBM::create(0, 16, 3);
+	}
+
+	copy_matcher_parameters(matcher, copy);
+	return copy;
+}
+
+int round_up_to_16(int value) {
+	return MAX(((value + 15)/16)*16, 16);
+}
+
+/* Computes the disparity at a lower resolution first, then runs the wrapped
+ * matcher on horizontal bands in parallel, each one searching only the range
+ * found on its rows plus a margin. The wrapped matcher holds the parameters,
+ * which are forwarded to it. ROIs are not supported, since bands are matched
+ * separately. */
+class HierarchicalMatcher : public StereoMatcher {
+public:
+	HierarchicalMatcher(const Ptr<StereoMatcher> &matcher, int band_height, int band_margin) :
+			matcher(matcher), band_height(band_height), band_margin(band_margin)
+		{}
+
+	void compute(InputArray left, InputArray right, OutputArray disparity);
+
+	int getMinDisparity() const { return matcher->getMinDisparity(); }
+	void setMinDisparity(int min_disparity) { matcher->setMinDisparity(min_disparity); }
+	int getNumDisparities() const { return matcher->getNumDisparities(); }
+	void setNumDisparities(int num_disparities) { matcher->setNumDisparities(num_disparities); }
+	int getBlockSize() const { return matcher->getBlockSize(); }
+	void setBlockSize(int block_size) { matcher->setBlockSize(block_size); }
+	int getSpeckleWindowSize() const { return matcher->getSpeckleWindowSize(); }
+	void setSpeckleWindowSize(int speckle_window_size) { matcher->setSpeckleWindowSize(speckle_window_size); }
+	int getSpeckleRange() const { return matcher->getSpeckleRange(); }
+	void setSpeckleRange(int speckle_range) { matcher->setSpeckleRange(speckle_range); }
+	int getDisp12MaxDiff() const { return matcher->getDisp12MaxDiff(); }
+	void setDisp12MaxDiff(int disp_12_max_diff) { matcher->setDisp12MaxDiff(disp_12_max_diff); }
+
+	Ptr<StereoMatcher> matcher;
+	int band_height;
+	int band_margin;
+
+	/* The coarse disparity is computed at 1/SCALE of the resolution */
+	static const int SCALE = 4;
+
+private:
+	struct BandRange {
+		int min_disparity;
+		int num_disparities;
+	};
+
+	/* Matches the bands assigned to one thread */
+	class BandBody : public ParallelLoopBody {
+	public:
+		BandBody(HierarchicalMatcher *owner, const Mat &left, const Mat &right, Mat &disparity) :
+				owner(owner), left(left), right(right), disparity(disparity)
+			{}
+
+		void operator()(const Range &range) const;
+
+	private:
+		HierarchicalMatcher *owner;
+		const Mat &left, &right;
+		Mat &disparity;
+	};
+
+	Ptr<StereoMatcher> coarse_matcher;
+	vector<Ptr<StereoMatcher> > band_matchers; /* One per band, so they can run concurrently */
+	vector<BandRange> band_ranges;
+};
+
+void HierarchicalMatcher::compute(InputArray left_array, InputArray right_array, OutputArray disparity_array) {
+	Mat left = left_array.getMat(), right = right_array.getMat();
+	int min_disparity = matcher->getMinDisparity();
+	int num_disparities = matcher->getNumDisparities();
+	int block_size = matcher->getBlockSize();
+	int height = MAX(band_height, 1);
+
+	Mat small_left, small_right, small_disparity;
+	resize(left, small_left, Size(), 1.0/SCALE, 1.0/SCALE, INTER_AREA);
+	resize(right, small_right, Size(), 1.0/SCALE, 1.0/SCALE, INTER_AREA);
+
+	int coarse_min_disparity = (int) floor((double) min_disparity/SCALE);
+	int coarse_num_disparities = round_up_to_16((num_disparities + SCALE - 1)/SCALE);
+
+	//Too small to be worth it, or to be matched at all:
+	if(left.rows <= height || small_left.cols <= coarse_num_disparities + block_size
+			|| small_left.rows <= block_size) {
+		matcher->compute(left, right, disparity_array);
 		return;
 	}
 
-	Ptr<StereoBM> stereo_bm;
-	Ptr<StereoSGBM> stereo_sgbm;
+	//The wrapped matcher never changes type, a new HierarchicalMatcher is created instead:
+	if(!coarse_matcher) {
+		coarse_matcher = copy_matcher(matcher);
+	} else {
+		copy_matcher_parameters(matcher, coarse_matcher);
+	}
+	coarse_matcher->setMinDisparity(coarse_min_disparity);
+	coarse_matcher->setNumDisparities(coarse_num_disparities);
+	coarse_matcher->compute(small_left, small_right, small_disparity);
+
+	//Range of each band from the valid coarse disparities on its rows:
+	int bands = (left.rows + height - 1)/height;
+	int max_disparity = min_disparity + num_disparities - 1;
+	band_ranges.resize(bands);
+
+	for(int band = 0; band < bands; band++) {
+		int first_row = band*height/SCALE;
+		int last_row = MIN(((band + 1)*height + SCALE - 1)/SCALE, small_disparity.rows);
+		int band_min = INT_MAX, band_max = INT_MIN;
+
+		for(int y = first_row; y < last_row; y++) {
+			const short *d = small_disparity.ptr<short>(y);
+
+			for(int x = 0; x < small_disparity.cols; x++) {
+				if(d[x] >= coarse_min_disparity*16) {
+					band_min = MIN(band_min, (int) d[x]);
+					band_max = MAX(band_max, (int) d[x]);
+				}
+			}
+		}
+
+		BandRange &range = band_ranges[band];
 
-	switch (data->matcher_type) {
-	case BM:
-		stereo_bm = data->stereo_matcher.dynamicCast<StereoBM>();
+		if(band_min > band_max) {
+			range.min_disparity = min_disparity;
+			range.num_disparities = num_disparities;
+			continue;
+		}
 
-		//If we have the wrong type of matcher, let's create a new one:
-		if (!stereo_bm) {
-			data->stereo_matcher = stereo_bm = StereoBM::create(16, 1);
-
-			gtk_widget_set_sensitive(data->sc_block_size, true);
-			gtk_widget_set_sensitive(data->sc_min_disparity, true);
-			gtk_widget_set_sensitive(data->sc_num_disparities, true);
-			gtk_widget_set_sensitive(data->sc_disp_max_diff, true);
-			gtk_widget_set_sensitive(data->sc_speckle_range, true);
-			gtk_widget_set_sensitive(data->sc_speckle_window_size, true);
-			gtk_widget_set_sensitive(data->sc_p1, false);
-			gtk_widget_set_sensitive(data->sc_p2, false);
-			gtk_widget_set_sensitive(data->sc_pre_filter_cap, true);
-			gtk_widget_set_sensitive(data->sc_pre_filter_size, true);
-			gtk_widget_set_sensitive(data->sc_uniqueness_ratio, true);
-			gtk_widget_set_sensitive(data->sc_texture_threshold, true);
-			gtk_widget_set_sensitive(data->rb_pre_filter_normalized, true);
-			gtk_widget_set_sensitive(data->rb_pre_filter_xsobel, true);
-			gtk_widget_set_sensitive(data->chk_full_dp, false);
-		}
-
-		stereo_bm->setBlockSize(data->block_size);
-		stereo_bm->setDisp12MaxDiff(data->disp_12_max_diff);
-		stereo_bm->setMinDisparity(data->min_disparity);
-		stereo_bm->setNumDisparities(data->num_disparities);
-		stereo_bm->setSpeckleRange(data->speckle_range);
-		stereo_bm->setSpeckleWindowSize(data->speckle_window_size);
+		int low = MAX((int) floor(band_min*SCALE/16.0) - band_margin, min_disparity);
+		int high = MIN((int) ceil(band_max*SCALE/16.0) + band_margin, max_disparity);
+		range.num_disparities = MIN(round_up_to_16(high - low + 1), num_disparities);
+		range.min_disparity = MAX(MIN(low, max_disparity + 1 - range.num_disparities), min_disparity);
+	}
+
+	while((int) band_matchers.size() < bands) {
+		band_matchers.push_back(Ptr<StereoMatcher>());
+	}
+
+	for(int band = 0; band < bands; band++) {
+		if(!band_matchers[band]) {
+			band_matchers[band] = copy_matcher(matcher);
+		} else {
+			copy_matcher_parameters(matcher, band_matchers[band]);
+		}
+		band_matchers[band]->setMinDisparity(band_ranges[band].min_disparity);
+		band_matchers[band]->setNumDisparities(band_ranges[band].num_disparities);
+	}
+
+	disparity_array.create(left.size(), CV_16S);
+	Mat disparity = disparity_array.getMat();
+	parallel_for_(Range(0, bands), BandBody(this, left, right, disparity));
+}
+
+void HierarchicalMatcher::BandBody::operator()(const Range &range) const {
+	int height = MAX(owner->band_height, 1);
+	int padding = owner->matcher->getBlockSize(); /* Rows of context above and below each band */
+	short invalid = (short) ((owner->matcher->getMinDisparity() - 1)*16);
+	Mat band_disparity;
+
+	for(int band = range.start; band < range.end; band++) {
+		int first_row = band*height;
+		int last_row = MIN(first_row + height, left.rows);
+		int first_padded_row = MAX(first_row - padding, 0);
+		int last_padded_row = MIN(last_row + padding, left.rows);
+
+		owner->band_matchers[band]->compute(left.rowRange(first_padded_row, last_padded_row),
+				right.rowRange(first_padded_row, last_padded_row), band_disparity);
+
+		//Mark invalid pixels with the value the full range would have used:
+		short band_invalid = (short) (owner->band_ranges[band].min_disparity*16);
+
+		for(int y = first_row; y < last_row; y++) {
+			const short *source = band_disparity.ptr<short>(y - first_padded_row);
+			short *destination = disparity.ptr<short>(y);
+
+			for(int x = 0; x < disparity.cols; x++) {
+				destination[x] = source[x] < band_invalid ? invalid : source[x];
+			}
+		}
+	}
+}
+
+/* The matcher doing the actual work, unwrapping the hierarchical one */
+Ptr<StereoMatcher> base_matcher(const Ptr<StereoMatcher> &matcher) {
+	Ptr<HierarchicalMatcher> hierarchical = matcher.dynamicCast<HierarchicalMatcher>();
+	return hierarchical ? hierarchical->matcher : matcher;
+}
+
+/* Copies the current parameters into an existing matcher */
+void configure_matcher(ChData *data, const Ptr<StereoMatcher> &wrapped_matcher) {
+	Ptr<HierarchicalMatcher> hierarchical = wrapped_matcher.dynamicCast<HierarchicalMatcher>();
+
+	if(hierarchical) {
+		hierarchical->band_height = data->band_height;
+		hierarchical->band_margin = data->band_margin;
+	}
+
+	Ptr<StereoMatcher> matcher = base_matcher(wrapped_matcher);
+	matcher->setBlockSize(data->block_size);
+	matcher->setDisp12MaxDiff(data->disp_12_max_diff);
+	matcher->setMinDisparity(data->min_disparity);
+	matcher->setNumDisparities(data->num_disparities);
+	matcher->setSpeckleRange(data->speckle_range);
+	matcher->setSpeckleWindowSize(data->speckle_window_size);
+
+	Ptr<StereoBM> stereo_bm = matcher.dynamicCast<StereoBM>();
+
+	if(stereo_bm) {
 		stereo_bm->setPreFilterCap(data->pre_filter_cap);
 		stereo_bm->setPreFilterSize(data->pre_filter_size);
 		stereo_bm->setPreFilterType(data->pre_filter_type);
 		stereo_bm->setTextureThreshold(data->texture_threshold);
 		stereo_bm->setUniquenessRatio(data->uniqueness_ratio);
+	}
 
-		if(data->roi1 != NULL && data->roi2 != NULL) {
-			stereo_bm->setROI1(*data->roi1);
-			stereo_bm->setROI2(*data->roi2);
-		}
-		break;
-
-	case SGBM:
-		stereo_sgbm = data->stereo_matcher.dynamicCast<StereoSGBM>();
+	Ptr<StereoSGBM> stereo_sgbm = matcher.dynamicCast<StereoSGBM>();
 
-		//If we have the wrong type of matcher, let's create a new one:
-		if (!stereo_sgbm) {
-			data->stereo_matcher = stereo_sgbm = StereoSGBM::create(
-					ChData::DEFAULT_MIN_DISPARITY,
-					ChData::DEFAULT_NUM_DISPARITIES, ChData::DEFAULT_BLOCK_SIZE,
-					ChData::DEFAULT_P1, ChData::DEFAULT_P2,
-					ChData::DEFAULT_DISP_12_MAX_DIFF,
-					ChData::DEFAULT_PRE_FILTER_CAP,
-					ChData::DEFAULT_UNIQUENESS_RATIO,
-					ChData::DEFAULT_SPECKLE_WINDOW_SIZE,
-					ChData::DEFAULT_SPECKLE_RANGE, ChData::DEFAULT_MODE);
-
-			gtk_widget_set_sensitive(data->sc_block_size, true);
-			gtk_widget_set_sensitive(data->sc_min_disparity, true);
-			gtk_widget_set_sensitive(data->sc_num_disparities, true);
-			gtk_widget_set_sensitive(data->sc_disp_max_diff, true);
-			gtk_widget_set_sensitive(data->sc_speckle_range, true);
-			gtk_widget_set_sensitive(data->sc_speckle_window_size, true);
-			gtk_widget_set_sensitive(data->sc_p1, true);
-			gtk_widget_set_sensitive(data->sc_p2, true);
-			gtk_widget_set_sensitive(data->sc_pre_filter_cap, true);
-			gtk_widget_set_sensitive(data->sc_pre_filter_size, false);
-			gtk_widget_set_sensitive(data->sc_uniqueness_ratio, true);
-			gtk_widget_set_sensitive(data->sc_texture_threshold, false);
-			gtk_widget_set_sensitive(data->rb_pre_filter_normalized, false);
-			gtk_widget_set_sensitive(data->rb_pre_filter_xsobel, false);
-			gtk_widget_set_sensitive(data->chk_full_dp, true);
-		}
-
-		stereo_sgbm->setBlockSize(data->block_size);
-		stereo_sgbm->setDisp12MaxDiff(data->disp_12_max_diff);
-		stereo_sgbm->setMinDisparity(data->min_disparity);
+	if(stereo_sgbm) {
 		stereo_sgbm->setMode(data->mode);
-		stereo_sgbm->setNumDisparities(data->num_disparities);
 		stereo_sgbm->setP1(data->p1);
 		stereo_sgbm->setP2(data->p2);
 		stereo_sgbm->setPreFilterCap(data->pre_filter_cap);
-		stereo_sgbm->setSpeckleRange(data->speckle_range);
-		stereo_sgbm->setSpeckleWindowSize(data->speckle_window_size);
 		stereo_sgbm->setUniquenessRatio(data->uniqueness_ratio);
+	}
+}
 
-		break;
+/* Creates a new matcher of the selected type with the current parameters */
+Ptr<StereoMatcher> create_matcher(ChData *data) {
+	Ptr<StereoMatcher> matcher;
+
+	if(data->matcher_type == BM) {
+		matcher = StereoBM::create(16, 1);
+	} else {
+		matcher = StereoSGBM::create(
+				ChData::DEFAULT_MIN_DISPARITY,
+				ChData::DEFAULT_NUM_DISPARITIES, ChData::DEFAULT_BLOCK_SIZE,
+				ChData::DEFAULT_P1, ChData::DEFAULT_P2,
+				ChData::DEFAULT_DISP_12_MAX_DIFF,
+				ChData::DEFAULT_PRE_FILTER_CAP,
+				ChData::DEFAULT_UNIQUENESS_RATIO,
+				ChData::DEFAULT_SPECKLE_WINDOW_SIZE,
+				ChData::DEFAULT_SPECKLE_RANGE, ChData::DEFAULT_MODE);
+	}
+
+	if(data->hierarchical) {
+		matcher = makePtr<HierarchicalMatcher>(matcher, data->band_height, data->band_margin);
 	}
 
-	clock_t t;
-	t = clock();
-	data->stereo_matcher->compute(data->cv_image_left, data->cv_image_right,
-			data->cv_image_disparity);
-	t = clock() - t;
+	configure_matcher(data, matcher);
+	return matcher;
+}
 
-	gchar *status_message = g_strdup_printf("Disparity computation took %lf milliseconds",((double)t*1000)/CLOCKS_PER_SEC);
-	gtk_statusbar_pop(GTK_STATUSBAR(data->status_bar), data->status_bar_context);
-	gtk_statusbar_push(GTK_STATUSBAR(data->status_bar), data->status_bar_context, status_message);
-	g_free(status_message);
+/* Sets the calibration ROIs on BM matchers. Not in hierarchical mode, where the bands are matched separately. */
+void apply_roi(ChData *data, const Ptr<StereoMatcher> &matcher) {
+	Ptr<StereoBM> stereo_bm = matcher.dynamicCast<StereoBM>();
 
-	normalize(data->cv_image_disparity, data->cv_image_disparity_normalized, 0,
-			255, CV_MINMAX, CV_8UC1);
-	cvtColor(data->cv_image_disparity_normalized, data->cv_color_image,
-			CV_GRAY2RGB);
-	GdkPixbuf *pixbuf = gdk_pixbuf_new_from_data(
-			(guchar*) data->cv_color_image.data, GDK_COLORSPACE_RGB, false,
-			8, data->cv_color_image.cols,
-			data->cv_color_image.rows, data->cv_color_image.step,
-			NULL, NULL);
-	gtk_image_set_from_pixbuf(data->image_depth, pixbuf);
+	if(stereo_bm && data->roi1 != NULL && data->roi2 != NULL) {
+		stereo_bm->setROI1(*data->roi1);
+		stereo_bm->setROI2(*data->roi2);
+	}
 }
 
-void update_interface(ChData *data) {
-	//Avoids rebuilding the matcher on every change:
-	data->live_update = false;
+/* Undistorts and rectifies an image of the left or right camera, if calibration files were given */
+void rectify_image(ChData *data, Mat &image, bool left) {
+	const Mat &map1 = left ? data->map11 : data->map21;
+	const Mat &map2 = left ? data->map12 : data->map22;
 
-	if(data->matcher_type == BM) {
-		gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(data->rb_bm),true);
-	} else {
-		gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(data->rb_sgbm),true);
+	if(!map1.empty()) {
+		Mat remapped;
+		remap(image, remapped, map1, map2, INTER_LINEAR);
+		image = remapped;
 	}
+}
 
-	gtk_adjustment_set_value(data->adj_block_size,data->block_size);
-	gtk_adjustment_set_value(data->adj_min_disparity,data->min_disparity);
-	gtk_adjustment_set_value(data->adj_num_disparities,data->num_disparities);
-	gtk_adjustment_set_value(data->adj_disp_max_diff,data->disp_12_max_diff);
-	gtk_adjustment_set_value(data->adj_speckle_range,data->speckle_range);
-	gtk_adjustment_set_value(data->adj_speckle_window_size,data->speckle_window_size);
-	gtk_adjustment_set_value(data->adj_p1,data->p1);
-	gtk_adjustment_set_value(data->adj_p2,data->p2);
-	gtk_adjustment_set_value(data->adj_pre_filter_cap,data->pre_filter_cap);
-	gtk_adjustment_set_value(data->adj_pre_filter_size,data->pre_filter_size);
-	gtk_adjustment_set_value(data->adj_uniqueness_ratio,data->uniqueness_ratio);
-	gtk_adjustment_set_value(data->adj_texture_threshold,data->texture_threshold);
-	gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(data->chk_full_dp),data->mode == StereoSGBM::MODE_HH);
+/* Reads the calibration files written by OpenCV's stereo_calib sample and
+ * computes the rectification maps for images of the given size */
+bool load_rectification(const char *intrinsics_filename, const char *extrinsics_filename, Size size, Rectification &rectification) {
+	FileStorage intrinsicsFs(intrinsics_filename,FileStorage::READ);
+
+	if(!intrinsicsFs.isOpened()) {
+		printf("Could not open intrinsic parameters file %s.\n", intrinsics_filename);
+		return false;
+	}
+
+	Mat m1, d1, m2, d2;
+	intrinsicsFs["M1"] >> m1;
+	intrinsicsFs["D1"] >> d1;
+	intrinsicsFs["M2"] >> m2;
+	intrinsicsFs["D2"] >> d2;
+
+	FileStorage extrinsicsFs(extrinsics_filename,FileStorage::READ);
+
+	if(!extrinsicsFs.isOpened()) {
+		printf("Could not open extrinsic parameters file %s.\n", extrinsics_filename);
+		return false;
+	}
+
+	Mat r,t;
+	extrinsicsFs["R"] >> r;
+	extrinsicsFs["T"] >> t;
+
+	Mat r1,p1,r2,p2;
+	stereoRectify(m1,d1,m2,d2,size,r,t,r1,r2,p1,p2,rectification.q,CALIB_ZERO_DISPARITY,-1,size,&rectification.roi1,&rectification.roi2);
+
+	initUndistortRectifyMap(m1, d1, r1, p1, size, CV_16SC2, rectification.map11, rectification.map12);
+	initUndistortRectifyMap(m2, d2, r2, p2, size, CV_16SC2, rectification.map21, rectification.map22);
+	return true;
+}
+
+/* Whether the matcher has the selected type and hierarchical mode */
+bool matcher_is_current(ChData *data, const Ptr<StereoMatcher> &wrapped_matcher) {
+	if(!wrapped_matcher) {
+		return false;
+	}
+
+	Ptr<StereoMatcher> matcher = base_matcher(wrapped_matcher);
+	bool right_type = data->matcher_type == BM ?
+			(bool) matcher.dynamicCast<StereoBM>() :
+			(bool) matcher.dynamicCast<StereoSGBM>();
+	bool is_hierarchical = wrapped_matcher.dynamicCast<HierarchicalMatcher>();
+
+	return right_type && is_hierarchical == (data->hierarchical != 0);
+}
+
+bool matcher_is_current(ChData *data) {
+	return matcher_is_current(data, data->stereo_matcher);
+}
+
+/* Dataset evaluation */
+
+/* Known Middlebury-style layouts. Ground truth images store the disparity
+ * multiplied by ground_truth_scale, with 0 meaning unknown. */
+struct DatasetLayout {
+	const char *left;
+	const char *right;
+	const char *ground_truth;
+	double ground_truth_scale;
+};
+
+static const DatasetLayout DATASET_LAYOUTS[] = {
+	{ "scene1.row3.col3.ppm", "scene1.row3.col5.ppm", "truedisp.row3.col3.pgm", 16 }, /* Tsukuba */
+	{ "im2.ppm", "im6.ppm", "disp2.pgm", 8 },       /* 2001 datasets */
+	{ "im2.png", "im6.png", "disp2.png", 4 },       /* 2003 datasets */
+	{ "view1.png", "view5.png", "disp1.png", 3 },   /* 2005 and 2006 datasets, third size */
+	{ "im0.png", "im1.png", NULL, 1 }               /* 2014 datasets, ground truth is PFM */
+};
+
+/* Pixels whose disparity is off by more than this are counted as bad */
+static const double DATASET_BAD_PIXEL_THRESHOLD = 1.0;
+
+struct DatasetPair {
+	string left_filename;
+	string right_filename;
+	string ground_truth_filename; /* Empty if there is no ground truth */
+	double ground_truth_scale;
+};
+
+struct DatasetFrame {
+	int index;
+	Mat left, right;  /* Grayscale, empty if decoding failed */
+	Mat ground_truth; /* CV_32F disparity in pixels, may be empty */
+};
+
+bool find_dataset_pair(const char *directory, DatasetPair &pair) {
+	for(size_t i = 0; i < sizeof(DATASET_LAYOUTS)/sizeof(DATASET_LAYOUTS[0]); i++) {
+		const DatasetLayout &layout = DATASET_LAYOUTS[i];
+		gchar *left = g_build_filename(directory, layout.left, NULL);
+		gchar *right = g_build_filename(directory, layout.right, NULL);
+		bool found = g_file_test(left, G_FILE_TEST_IS_REGULAR) && g_file_test(right, G_FILE_TEST_IS_REGULAR);
+
+		if(found) {
+			pair.left_filename = left;
+			pair.right_filename = right;
+			pair.ground_truth_filename.clear();
+			pair.ground_truth_scale = layout.ground_truth_scale;
+
+			if(layout.ground_truth != NULL) {
+				gchar *ground_truth = g_build_filename(directory, layout.ground_truth, NULL);
+
+				if(g_file_test(ground_truth, G_FILE_TEST_IS_REGULAR)) {
+					pair.ground_truth_filename = ground_truth;
+				}
+				g_free(ground_truth);
+			}
+		}
+
+		g_free(left);
+		g_free(right);
+
+		if(found) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* Image sequences, with left and right images of the same name in two subdirectories */
+static const char *SEQUENCE_LAYOUTS[][2] = {
+	{ "left", "right" },
+	{ "image_2", "image_3" }, /* KITTI, color */
+	{ "image_0", "image_1" }  /* KITTI, grayscale */
+};
+
+bool scan_sequence(const char *directory, vector<DatasetPair> &pairs) {
+	for(size_t i = 0; i < sizeof(SEQUENCE_LAYOUTS)/sizeof(SEQUENCE_LAYOUTS[0]); i++) {
+		gchar *left_directory = g_build_filename(directory, SEQUENCE_LAYOUTS[i][0], NULL);
+		gchar *right_directory = g_build_filename(directory, SEQUENCE_LAYOUTS[i][1], NULL);
+		GDir *dir = g_dir_open(left_directory, 0, NULL);
+
+		if(dir != NULL && g_file_test(right_directory, G_FILE_TEST_IS_DIR)) {
+			vector<string> names;
+			const gchar *name;
+
+			while((name = g_dir_read_name(dir)) != NULL) {
+				names.push_back(name);
+			}
+			sort(names.begin(), names.end());
+
+			for(size_t j = 0; j < names.size(); j++) {
+				gchar *left = g_build_filename(left_directory, names[j].c_str(), NULL);
+				gchar *right = g_build_filename(right_directory, names[j].c_str(), NULL);
+
+				if(g_file_test(left, G_FILE_TEST_IS_REGULAR) && g_file_test(right, G_FILE_TEST_IS_REGULAR)) {
+					DatasetPair pair;
+					pair.left_filename = left;
+					pair.right_filename = right;
+					pair.ground_truth_scale = 1;
+					pairs.push_back(pair);
+				}
+
+				g_free(left);
+				g_free(right);
+			}
+		}
+
+		if(dir != NULL) {
+			g_dir_close(dir);
+		}
+		g_free(left_directory);
+		g_free(right_directory);
+
+		if(!pairs.empty()) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* Looks for pairs in the directory itself and in its immediate subdirectories */
+vector<DatasetPair> scan_dataset(const char *directory) {
+	vector<DatasetPair> pairs;
+	DatasetPair pair;
+
+	if(find_dataset_pair(directory, pair)) {
+		pairs.push_back(pair);
+	}
+
+	GDir *dir = g_dir_open(directory, 0, NULL);
+
+	if(dir != NULL) {
+		vector<string> names;
+		const gchar *name;
+
+		while((name = g_dir_read_name(dir)) != NULL) {
+			names.push_back(name);
+		}
+		g_dir_close(dir);
+		sort(names.begin(), names.end());
+
+		for(size_t i = 0; i < names.size(); i++) {
+			gchar *path = g_build_filename(directory, names[i].c_str(), NULL);
+
+			if(g_file_test(path, G_FILE_TEST_IS_DIR) && find_dataset_pair(path, pair)) {
+				pairs.push_back(pair);
+			}
+			g_free(path);
+		}
+	}
+
+	return pairs;
+}
+
+/* Decodes the given pairs of a dataset on background threads into a bounded
+ * queue. At most "depth" frames are decoded or waiting to be consumed at any
+ * time, so memory stays bounded regardless of the dataset size. Frames may
+ * come out of order. */
+class PrefetchLoader {
+public:
+	PrefetchLoader(const vector<DatasetPair> &pairs, const vector<int> &indices, int depth);
+	~PrefetchLoader();
+
+	/* Blocks until a frame is available. Returns false once every pair was consumed. */
+	bool pop(DatasetFrame &frame);
+
+private:
+	static gpointer decode_thread(gpointer user_data);
+	void decode(int index, DatasetFrame &frame);
+
+	const vector<DatasetPair> &pairs;
+	vector<int> indices; /* Pairs to decode */
+	size_t depth;
+	GMutex mutex;
+	GCond cond;
+	deque<DatasetFrame> queue;
+	int next_index; /* Next of the indices to be decoded */
+	size_t decoding; /* Frames being decoded right now */
+	size_t remaining; /* Frames not yet popped */
+	bool stopped;
+	vector<GThread*> threads;
+};
+
+PrefetchLoader::PrefetchLoader(const vector<DatasetPair> &pairs, const vector<int> &indices, int depth) :
+		pairs(pairs), indices(indices), depth(MAX(depth, 1)), next_index(0), decoding(0),
+		remaining(indices.size()), stopped(false) {
+	g_mutex_init(&mutex);
+	g_cond_init(&cond);
+
+	int num_threads = MIN((int) this->depth, (int) g_get_num_processors());
+
+	for(int i = 0; i < num_threads; i++) {
+		threads.push_back(g_thread_new("prefetch", decode_thread, this));
+	}
+}
+
+PrefetchLoader::~PrefetchLoader() {
+	g_mutex_lock(&mutex);
+	stopped = true;
+	g_cond_broadcast(&cond);
+	g_mutex_unlock(&mutex);
+
+	for(size_t i = 0; i < threads.size(); i++) {
+		g_thread_join(threads[i]);
+	}
+
+	g_cond_clear(&cond);
+	g_mutex_clear(&mutex);
+}
+
+bool PrefetchLoader::pop(DatasetFrame &frame) {
+	g_mutex_lock(&mutex);
+
+	while(!stopped && remaining > 0 && queue.empty()) {
+		g_cond_wait(&cond, &mutex);
+	}
+
+	if(stopped || remaining == 0) {
+		g_mutex_unlock(&mutex);
+		return false;
+	}
+
+	frame = queue.front();
+	queue.pop_front();
+	remaining--;
+	g_cond_broadcast(&cond);
+	g_mutex_unlock(&mutex);
+	return true;
+}
+
+gpointer PrefetchLoader::decode_thread(gpointer user_data) {
+	PrefetchLoader *loader = (PrefetchLoader*) user_data;
+
+	g_mutex_lock(&loader->mutex);
+
+	for(;;) {
+		while(!loader->stopped && loader->next_index < (int) loader->indices.size()
+				&& loader->queue.size() + loader->decoding >= loader->depth) {
+			g_cond_wait(&loader->cond, &loader->mutex);
+		}
+
+		if(loader->stopped || loader->next_index >= (int) loader->indices.size()) {
+			break;
+		}
+
+		int index = loader->indices[loader->next_index++];
+		loader->decoding++;
+		g_mutex_unlock(&loader->mutex);
+
+		DatasetFrame frame;
+		loader->decode(index, frame);
+
+		g_mutex_lock(&loader->mutex);
+		loader->decoding--;
+		loader->queue.push_back(frame);
+		g_cond_broadcast(&loader->cond);
+	}
+
+	g_mutex_unlock(&loader->mutex);
+	return NULL;
+}
+
+void PrefetchLoader::decode(int index, DatasetFrame &frame) {
+	const DatasetPair &pair = pairs[index];
+
+	frame.index = index;
+	frame.left = imread(pair.left_filename, IMREAD_GRAYSCALE);
+	frame.right = imread(pair.right_filename, IMREAD_GRAYSCALE);
+
+	if(frame.left.empty() || frame.right.empty() || frame.left.size() != frame.right.size()) {
+		fprintf(stderr, "WARNING: could not read dataset pair %s, %s\n",
+				pair.left_filename.c_str(), pair.right_filename.c_str());
+		frame.left.release();
+		frame.right.release();
+		return;
+	}
+
+	if(!pair.ground_truth_filename.empty()) {
+		Mat ground_truth = imread(pair.ground_truth_filename, IMREAD_UNCHANGED);
+
+		if(ground_truth.size() == frame.left.size() && ground_truth.channels() == 1) {
+			ground_truth.convertTo(frame.ground_truth, CV_32F, 1.0/pair.ground_truth_scale);
+		} else {
+			fprintf(stderr, "WARNING: ignoring ground truth %s\n", pair.ground_truth_filename.c_str());
+		}
+	}
+}
+
+/* Aggregated results of an evaluation pass, possibly still in progress */
+struct DatasetReport {
+	ChData *data;
+	gint generation;
+	int total;
+	int evaluated;
+	int failed;
+	long ground_truth_pixels;
+	long bad_pixels;
+	long valid_pixels; /* Pixels with ground truth and a valid disparity */
+	double total_error;
+	double decode_wait; /* Milliseconds the matcher spent waiting for the loader */
+	vector<double> latencies; /* Milliseconds */
+	bool finished;
+
+	DatasetReport() : data(NULL), generation(0), total(0), evaluated(0), failed(0),
+			ground_truth_pixels(0), bad_pixels(0), valid_pixels(0), total_error(0),
+			decode_wait(0), finished(false)
+		{}
+};
+
+/* Evaluates the dataset on a background thread. Every parameter change
+ * cancels the pass in progress and starts a new one, whose partial results
+ * are reported as each pair completes. Decoded frames are kept for the next
+ * passes up to cache_limit bytes, only the others are decoded again. */
+struct DatasetEvaluator {
+	ChData *data;
+	vector<DatasetPair> pairs;
+	int prefetch_depth;
+	vector<DatasetFrame> frames; /* Only used by the evaluation thread */
+	vector<bool> cached;
+	size_t cache_bytes;
+	size_t cache_limit;
+	GThread *thread;
+	GMutex mutex;
+	GCond cond;
+	Ptr<StereoMatcher> pending_matcher; /* Matcher for the next pass, empty if idle */
+	volatile gint generation;
+	bool quit;
+
+	static const int DEFAULT_PREFETCH_DEPTH = 8;
+	static const int DEFAULT_CACHE_MEGABYTES = 512;
+};
+
+double percentile(vector<double> values, double p) {
+	if(values.empty()) {
+		return 0;
+	}
+
+	sort(values.begin(), values.end());
+	size_t rank = (size_t) ceil(p*values.size());
+	return values[rank > 0 ? rank - 1 : 0];
+}
+
+gboolean on_dataset_report(gpointer user_data) {
+	DatasetReport *report = (DatasetReport*) user_data;
+	ChData *data = report->data;
+
+	//Only show results computed with the current parameters:
+	if(report->generation == g_atomic_int_get(&data->dataset->generation)) {
+		GString *text = g_string_new(NULL);
+
+		g_string_append_printf(text, "Dataset: %d/%d pairs%s", report->evaluated, report->total,
+				report->finished ? "" : " (evaluating...)");
+
+		if(report->failed > 0) {
+			g_string_append_printf(text, ", %d unreadable", report->failed);
+		}
+
+		if(report->ground_truth_pixels > 0) {
+			g_string_append_printf(text, " | bad > %.1lf px: %.2lf%%, avg error: %.2lf px, density: %.1lf%%",
+					DATASET_BAD_PIXEL_THRESHOLD,
+					100.0*report->bad_pixels/report->ground_truth_pixels,
+					report->valid_pixels > 0 ? report->total_error/report->valid_pixels : 0.0,
+					100.0*report->valid_pixels/report->ground_truth_pixels);
+		}
+
+		g_string_append_printf(text, " | latency p50: %.1lf ms, p95: %.1lf ms | waited %.1lf ms on decoding",
+				percentile(report->latencies, 0.5), percentile(report->latencies, 0.95),
+				report->decode_wait);
+
+		gtk_label_set_text(data->lbl_dataset, text->str);
+		g_string_free(text, TRUE);
+	}
+
+	delete report;
+	return FALSE;
+}
+
+void accumulate_accuracy(const Mat &disparity, const Mat &ground_truth, int min_disparity,
+		DatasetReport &report) {
+	for(int y = 0; y < disparity.rows; y++) {
+		const short *d = disparity.ptr<short>(y);
+		const float *gt = ground_truth.ptr<float>(y);
+
+		for(int x = 0; x < disparity.cols; x++) {
+			if(gt[x] <= 0) {
+				continue;
+			}
+
+			report.ground_truth_pixels++;
+
+			//Invalid disparities are counted as bad pixels:
+			if(d[x] < min_disparity*16) {
+				report.bad_pixels++;
+				continue;
+			}
+
+			double error = fabs(d[x]/16.0 - gt[x]);
+			report.valid_pixels++;
+			report.total_error += error;
+
+			if(error > DATASET_BAD_PIXEL_THRESHOLD) {
+				report.bad_pixels++;
+			}
+		}
+	}
+}
+
+void evaluate_dataset(DatasetEvaluator *evaluator, const Ptr<StereoMatcher> &matcher, gint generation) {
+	DatasetReport report;
+	report.data = evaluator->data;
+	report.generation = generation;
+	report.total = evaluator->pairs.size();
+
+	//The frames already decoded are matched while the loader decodes the others:
+	vector<int> cached, missing;
+
+	for(size_t i = 0; i < evaluator->pairs.size(); i++) {
+		(evaluator->cached[i] ? cached : missing).push_back(i);
+	}
+
+	PrefetchLoader loader(evaluator->pairs, missing, evaluator->prefetch_depth);
+	DatasetFrame frame;
+	Mat disparity;
+	size_t next_cached = 0;
+
+	for(;;) {
+		bool more = true;
+
+		if(next_cached < cached.size()) {
+			frame = evaluator->frames[cached[next_cached++]];
+		} else {
+			gint64 wait_start = g_get_monotonic_time();
+			more = loader.pop(frame);
+			report.decode_wait += (g_get_monotonic_time() - wait_start)/1000.0;
+
+			if(more) {
+				size_t bytes = frame.left.total()*frame.left.elemSize() + frame.right.total()*frame.right.elemSize()
+						+ frame.ground_truth.total()*frame.ground_truth.elemSize();
+
+				if(evaluator->cache_bytes + bytes <= evaluator->cache_limit) {
+					evaluator->frames[frame.index] = frame;
+					evaluator->cached[frame.index] = true;
+					evaluator->cache_bytes += bytes;
+				}
+			}
+		}
+
+		if(!more || g_atomic_int_get(&evaluator->generation) != generation) {
+			break;
+		}
+
+		report.evaluated++;
+
+		if(frame.left.empty()) {
+			report.failed++;
+		} else {
+			gint64 start = g_get_monotonic_time();
+			matcher->compute(frame.left, frame.right, disparity);
+			report.latencies.push_back((g_get_monotonic_time() - start)/1000.0);
+
+			if(!frame.ground_truth.empty()) {
+				accumulate_accuracy(disparity, frame.ground_truth, matcher->getMinDisparity(), report);
+			}
+		}
+
+		report.finished = report.evaluated == report.total;
+		g_idle_add(on_dataset_report, new DatasetReport(report));
+	}
+}
+
+gpointer dataset_evaluator_thread(gpointer user_data) {
+	DatasetEvaluator *evaluator = (DatasetEvaluator*) user_data;
+
+	for(;;) {
+		g_mutex_lock(&evaluator->mutex);
+
+		while(!evaluator->quit && evaluator->pending_matcher.empty()) {
+			g_cond_wait(&evaluator->cond, &evaluator->mutex);
+		}
+
+		if(evaluator->quit) {
+			g_mutex_unlock(&evaluator->mutex);
+			break;
+		}
+
+		Ptr<StereoMatcher> matcher = evaluator->pending_matcher;
+		evaluator->pending_matcher.release();
+		gint generation = g_atomic_int_get(&evaluator->generation);
+		g_mutex_unlock(&evaluator->mutex);
+
+		evaluate_dataset(evaluator, matcher, generation);
+	}
+
+	return NULL;
+}
+
+DatasetEvaluator *dataset_evaluator_new(ChData *data, const vector<DatasetPair> &pairs, int prefetch_depth, int cache_megabytes) {
+	DatasetEvaluator *evaluator = new DatasetEvaluator();
+	evaluator->data = data;
+	evaluator->pairs = pairs;
+	evaluator->prefetch_depth = prefetch_depth;
+	evaluator->frames.resize(pairs.size());
+	evaluator->cached.assign(pairs.size(), false);
+	evaluator->cache_bytes = 0;
+	evaluator->cache_limit = (size_t) MAX(cache_megabytes, 0)*1024*1024;
+	evaluator->generation = 0;
+	evaluator->quit = false;
+	g_mutex_init(&evaluator->mutex);
+	g_cond_init(&evaluator->cond);
+	evaluator->thread = g_thread_new("dataset", dataset_evaluator_thread, evaluator);
+	return evaluator;
+}
+
+/* Starts a new pass with the given matcher, cancelling the one in progress */
+void dataset_evaluator_schedule(DatasetEvaluator *evaluator, const Ptr<StereoMatcher> &matcher) {
+	g_mutex_lock(&evaluator->mutex);
+	g_atomic_int_inc(&evaluator->generation);
+	evaluator->pending_matcher = matcher;
+	g_cond_signal(&evaluator->cond);
+	g_mutex_unlock(&evaluator->mutex);
+}
+
+void dataset_evaluator_free(DatasetEvaluator *evaluator) {
+	g_mutex_lock(&evaluator->mutex);
+	evaluator->quit = true;
+	g_atomic_int_inc(&evaluator->generation);
+	g_cond_signal(&evaluator->cond);
+	g_mutex_unlock(&evaluator->mutex);
+
+	g_thread_join(evaluator->thread);
+	g_cond_clear(&evaluator->cond);
+	g_mutex_clear(&evaluator->mutex);
+	delete evaluator;
+}
+
+/* Session recording and replay */
+
+/* Parameters written to the session log, using the same names as the saved files */
+struct SessionParameter {
+	const char *name;
+	int ChData::*field;
+};
+
+static const SessionParameter SESSION_PARAMETERS[] = {
+	{ "blockSize", &ChData::block_size },
+	{ "minDisparity", &ChData::min_disparity },
+	{ "numDisparities", &ChData::num_disparities },
+	{ "disp12MaxDiff", &ChData::disp_12_max_diff },
+	{ "speckleRange", &ChData::speckle_range },
+	{ "speckleWindowSize", &ChData::speckle_window_size },
+	{ "preFilterCap", &ChData::pre_filter_cap },
+	{ "preFilterSize", &ChData::pre_filter_size },
+	{ "preFilterType", &ChData::pre_filter_type },
+	{ "textureThreshold", &ChData::texture_threshold },
+	{ "uniquenessRatio", &ChData::uniqueness_ratio },
+	{ "P1", &ChData::p1 },
+	{ "P2", &ChData::p2 },
+	{ "mode", &ChData::mode },
+	{ "hierarchical", &ChData::hierarchical },
+	{ "bandHeight", &ChData::band_height },
+	{ "bandMargin", &ChData::band_margin }
+};
+
+static const int SESSION_PARAMETER_COUNT = sizeof(SESSION_PARAMETERS)/sizeof(SESSION_PARAMETERS[0]);
+
+/* Files given on the command line, NULL for those not used */
+struct SessionInputs {
+	const char *left;
+	const char *right;
+	const char *intrinsics;
+	const char *extrinsics;
+};
+
+/* Inputs written to the session log as "input <name> <path>" */
+struct SessionInput {
+	const char *name;
+	const char *SessionInputs::*field;
+};
+
+static const SessionInput SESSION_INPUTS[] = {
+	{ "left", &SessionInputs::left },
+	{ "right", &SessionInputs::right },
+	{ "intrinsics", &SessionInputs::intrinsics },
+	{ "extrinsics", &SessionInputs::extrinsics }
+};
+
+static const int SESSION_INPUT_COUNT = sizeof(SESSION_INPUTS)/sizeof(SESSION_INPUTS[0]);
+
+bool session_open(ChData *data, const char *filename, const SessionInputs &inputs) {
+	data->session_log = fopen(filename, "w");
+
+	if(data->session_log == NULL) {
+		return false;
+	}
+
+	fprintf(data->session_log, "# Stereo Tuner session, OpenCV %s\n", CV_VERSION);
+	fprintf(data->session_log, "threads %d\n", getNumThreads());
+
+	for(int i = 0; i < SESSION_INPUT_COUNT; i++) {
+		const char *path = inputs.*SESSION_INPUTS[i].field;
+
+		if(path != NULL) {
+			fprintf(data->session_log, "input %s %s\n", SESSION_INPUTS[i].name, path);
+		}
+	}
+
+	fprintf(data->session_log, "image %d %d\n", data->cv_image_left.cols, data->cv_image_left.rows);
+	fflush(data->session_log);
+	return true;
+}
+
+/* Writes one step with the parameters that changed since the previous one:
+ * step <milliseconds since the first step> <compute milliseconds> [name=value...] */
+void session_record(ChData *data, gint64 start, double elapsed) {
+	bool first = data->session_values.empty();
+
+	if(first) {
+		data->session_start = start;
+		data->session_values.assign(SESSION_PARAMETER_COUNT, 0);
+	}
+
+	fprintf(data->session_log, "step %.1lf %.3lf", (start - data->session_start)/1000.0, elapsed);
+
+	if(first || data->session_matcher_type != data->matcher_type) {
+		fprintf(data->session_log, " algorithm=%s", data->matcher_type == BM ? "BM" : "SGBM");
+		data->session_matcher_type = data->matcher_type;
+	}
+
+	for(int i = 0; i < SESSION_PARAMETER_COUNT; i++) {
+		int value = data->*SESSION_PARAMETERS[i].field;
+
+		if(first || value != data->session_values[i]) {
+			fprintf(data->session_log, " %s=%d", SESSION_PARAMETERS[i].name, value);
+			data->session_values[i] = value;
+		}
+	}
+
+	fprintf(data->session_log, "\n");
+	fflush(data->session_log);
+}
+
+bool session_apply(ChData *data, const char *assignment) {
+	const char *separator = strchr(assignment, '=');
+
+	if(separator == NULL) {
+		return false;
+	}
+
+	string name(assignment, separator - assignment);
+	const char *value = separator + 1;
+
+	if(name == "algorithm") {
+		data->matcher_type = strcmp(value, "SGBM") == 0 ? SGBM : BM;
+		return true;
+	}
+
+	for(int i = 0; i < SESSION_PARAMETER_COUNT; i++) {
+		if(name == SESSION_PARAMETERS[i].name) {
+			data->*SESSION_PARAMETERS[i].field = atoi(value);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* Warns if an input of the replay is not the one the session was recorded with */
+void session_check_input(const char *name, const char *recorded, const char *replayed) {
+	if(replayed == NULL) {
+		fprintf(stderr, "WARNING: session was recorded with %s %s, replaying without it\n", name, recorded);
+	} else if(recorded == NULL) {
+		fprintf(stderr, "WARNING: session was recorded without %s, replaying with %s\n", name, replayed);
+	} else if(strcmp(recorded, replayed) != 0) {
+		fprintf(stderr, "WARNING: session was recorded with %s %s, replaying with %s\n", name, recorded, replayed);
+	}
+}
+
+/* Replays a recorded session without the interface, reusing the matcher
+ * between steps just like update_matcher() does, and prints the recorded
+ * and replayed compute times of every step. The inputs and the number of
+ * threads are compared with the recorded ones, and only warned about since
+ * the same images may have been copied elsewhere. Returns the exit status:
+ * 1 if the log could not be read, 2 if the total time got slower than the
+ * recorded one by more than tolerance percent (negative to disable). */
+int session_replay(ChData *data, const char *filename, const SessionInputs &inputs, double tolerance) {
+	FILE *log = fopen(filename, "r");
+
+	if(log == NULL) {
+		printf("Could not open session log %s.\n", filename);
+		return 1;
+	}
+
+	char line[4096];
+	int step = 0;
+	double recorded_total = 0, replayed_total = 0;
+	vector<double> ratios;
+	vector<bool> recorded_inputs(SESSION_INPUT_COUNT, false);
+	bool inputs_recorded = false;
+
+	printf("%6s %12s %12s %8s  %s\n", "step", "recorded_ms", "replayed_ms", "ratio", "changes");
+
+	while(fgets(line, sizeof(line), log) != NULL) {
+		g_strstrip(line);
+
+		if(line[0] == '#' || line[0] == '\0') {
+			continue;
+		}
+
+		gchar **tokens = g_strsplit(line, " ", -1);
+
+		if(strcmp(tokens[0], "threads") == 0 && tokens[1] != NULL) {
+			if(atoi(tokens[1]) != getNumThreads()) {
+				fprintf(stderr, "WARNING: session was recorded with %s threads, replaying with %d\n",
+						tokens[1], getNumThreads());
+			}
+		} else if(strcmp(tokens[0], "input") == 0 && tokens[1] != NULL && tokens[2] != NULL) {
+			//The path is the rest of the line, it may have spaces:
+			const char *path = line + strlen(tokens[0]) + 1 + strlen(tokens[1]) + 1;
+			inputs_recorded = true;
+
+			for(int i = 0; i < SESSION_INPUT_COUNT; i++) {
+				if(strcmp(tokens[1], SESSION_INPUTS[i].name) == 0) {
+					session_check_input(SESSION_INPUTS[i].name, path, inputs.*SESSION_INPUTS[i].field);
+					recorded_inputs[i] = true;
+				}
+			}
+		} else if(strcmp(tokens[0], "image") == 0 && tokens[1] != NULL && tokens[2] != NULL) {
+			if(atoi(tokens[1]) != data->cv_image_left.cols || atoi(tokens[2]) != data->cv_image_left.rows) {
+				fprintf(stderr, "WARNING: session was recorded on %sx%s images, replaying on %dx%d\n",
+						tokens[1], tokens[2], data->cv_image_left.cols, data->cv_image_left.rows);
+			}
+		} else if(strcmp(tokens[0], "step") == 0 && tokens[1] != NULL && tokens[2] != NULL) {
+			double recorded = g_ascii_strtod(tokens[2], NULL);
+			GString *changes = g_string_new(NULL);
+
+			for(int i = 3; tokens[i] != NULL; i++) {
+				if(!session_apply(data, tokens[i])) {
+					fprintf(stderr, "WARNING: ignoring unknown parameter %s\n", tokens[i]);
+				}
+				g_string_append_printf(changes, "%s ", tokens[i]);
+			}
+
+			if(!matcher_is_current(data)) {
+				data->stereo_matcher = create_matcher(data);
+			}
+			configure_matcher(data, data->stereo_matcher);
+			apply_roi(data, data->stereo_matcher);
+
+			gint64 start = g_get_monotonic_time();
+			data->stereo_matcher->compute(data->cv_image_left, data->cv_image_right,
+					data->cv_image_disparity);
+			double replayed = (g_get_monotonic_time() - start)/1000.0;
+
+			double ratio = recorded > 0 ? replayed/recorded : 0;
+			printf("%6d %12.3lf %12.3lf %8.2lf  %s\n", step, recorded, replayed, ratio, changes->str);
+			g_string_free(changes, TRUE);
+
+			recorded_total += recorded;
+			replayed_total += replayed;
+
+			if(recorded > 0) {
+				ratios.push_back(ratio);
+			}
+			step++;
+		} else if(strcmp(tokens[0], "memory") == 0) {
+			//Recorded with -instrument, only informative
+		} else {
+			fprintf(stderr, "WARNING: ignoring invalid line in session log: %s\n", line);
+		}
+
+		g_strfreev(tokens);
+	}
+
+	fclose(log);
+
+	//Logs written before the inputs were recorded have none:
+	for(int i = 0; i < SESSION_INPUT_COUNT && inputs_recorded; i++) {
+		if(!recorded_inputs[i] && inputs.*SESSION_INPUTS[i].field != NULL) {
+			session_check_input(SESSION_INPUTS[i].name, NULL, inputs.*SESSION_INPUTS[i].field);
+		}
+	}
+
+	if(step == 0) {
+		printf("Session log %s has no steps.\n", filename);
+		return 1;
+	}
+
+	double change = recorded_total > 0 ? 100.0*(replayed_total - recorded_total)/recorded_total : 0;
+	printf("Replayed %d steps: recorded %.3lf ms, replayed %.3lf ms (%+.1lf%%), ratio p50: %.2lf, p95: %.2lf\n",
+			step, recorded_total, replayed_total, change,
+			percentile(ratios, 0.5), percentile(ratios, 0.95));
+
+	if(tolerance >= 0 && change > tolerance) {
+		printf("Regression: replay is more than %.1lf%% slower than the recording.\n", tolerance);
+		return 2;
+	}
+
+	return 0;
+}
+
+/* Shows a message on the status bar until the next computation */
+void show_status_message(ChData *data, const gchar *message) {
+	gtk_statusbar_pop(GTK_STATUSBAR(data->status_bar), data->message_status_context);
+	gtk_statusbar_push(GTK_STATUSBAR(data->status_bar), data->message_status_context, message);
+}
+
+/* Disparity export */
+
+/* Header of the .disp container, followed by the parameters as text and by
+ * the CV_16S disparity rows (fixed point, 4 fractional bits), which may be
+ * zlib compressed. All fields are in the byte order of the writing machine. */
+struct DisparityHeader {
+	char magic[8];          /* "STDISP1" */
+	guint32 width;
+	guint32 height;
+	guint32 compression;    /* 0 for raw, 1 for zlib */
+	guint32 parameters_length;
+	guint64 payload_length; /* Bytes of disparity data, after compression */
+	double q[16];           /* Disparity-to-depth matrix, all zeros if unknown */
+};
+
+struct ExportJob {
+	DisparityExporter *exporter;
+	ChData *data;
+	Mat disparity;
+	Mat q;
+	string filename;
+	string parameters;
+	ExportFormat format;
+	bool notify; /* Report success on the status bar, errors are always reported */
+	bool success;
+	double elapsed;
+};
+
+/* Encodes disparities on a pool of background threads. At most "capacity"
+ * jobs may be waiting or running, after that export_disparity() blocks. */
+struct DisparityExporter {
+	GThreadPool *pool;
+	GMutex mutex;
+	GCond cond;
+	int pending;
+	int capacity;
+
+	static const int DEFAULT_CAPACITY = 8;
+};
+
+/* Parameters as "name=value" pairs, as written in the session logs */
+string describe_parameters(ChData *data) {
+	string description = data->matcher_type == BM ? "algorithm=BM" : "algorithm=SGBM";
+
+	for(int i = 0; i < SESSION_PARAMETER_COUNT; i++) {
+		gchar *parameter = g_strdup_printf(" %s=%d", SESSION_PARAMETERS[i].name, data->*SESSION_PARAMETERS[i].field);
+		description += parameter;
+		g_free(parameter);
+	}
+
+	return description;
+}
+
+bool export_format_from_filename(const char *filename, ExportFormat &format) {
+	if(g_str_has_suffix(filename, ".png")) {
+		format = EXPORT_PNG;
+	} else if(g_str_has_suffix(filename, ".disp")) {
+		format = EXPORT_RAW;
+	} else if(g_str_has_suffix(filename, ".dispz")) {
+		format = EXPORT_COMPRESSED;
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+const char *export_format_extension(ExportFormat format) {
+	switch(format) {
+	case EXPORT_RAW:
+		return "disp";
+	case EXPORT_COMPRESSED:
+		return "dispz";
+	default:
+		return "png";
+	}
+}
+
+/* 16-bit PNG with the disparity multiplied by 16, invalid and negative disparities are 0 */
+bool write_disparity_png(const ExportJob *job) {
+	Mat disparity_16u;
+	job->disparity.convertTo(disparity_16u, CV_16U);
+
+	vector<int> params;
+	params.push_back(IMWRITE_PNG_COMPRESSION);
+	params.push_back(1);
+	return imwrite(job->filename, disparity_16u, params);
+}
+
+bool write_disparity_container(const ExportJob *job) {
+	const guchar *payload = job->disparity.data;
+	gsize payload_length = job->disparity.total()*job->disparity.elemSize();
+	vector<guchar> compressed;
+
+	DisparityHeader header;
+	memset(&header, 0, sizeof(header));
+	strcpy(header.magic, "STDISP1");
+	header.width = job->disparity.cols;
+	header.height = job->disparity.rows;
+	header.parameters_length = job->parameters.size();
+
+	if(!job->q.empty()) {
+		Mat q;
+		job->q.convertTo(q, CV_64F);
+
+		for(int i = 0; i < 16; i++) {
+			header.q[i] = q.at<double>(i/4, i%4);
+		}
+	}
+
+	if(job->format == EXPORT_COMPRESSED) {
+		//Fastest zlib level, the output buffer is larger than zlib's worst case:
+		GConverter *compressor = G_CONVERTER(g_zlib_compressor_new(G_ZLIB_COMPRESSOR_FORMAT_ZLIB, 1));
+		gsize read, written;
+		compressed.resize(payload_length + payload_length/1000 + 64);
+
+		GConverterResult result = g_converter_convert(compressor, payload, payload_length,
+				&compressed[0], compressed.size(), G_CONVERTER_INPUT_AT_END,
+				&read, &written, NULL);
+		g_object_unref(compressor);
+
+		if(result == G_CONVERTER_FINISHED) {
+			header.compression = 1;
+			payload = &compressed[0];
+			payload_length = written;
+		} else {
+			fprintf(stderr, "WARNING: could not compress %s, writing it uncompressed\n", job->filename.c_str());
+		}
+	}
+
+	header.payload_length = payload_length;
+
+	FILE *file = fopen(job->filename.c_str(), "wb");
+
+	if(file == NULL) {
+		return false;
+	}
+
+	bool success = fwrite(&header, sizeof(header), 1, file) == 1
+			&& fwrite(job->parameters.data(), 1, job->parameters.size(), file) == job->parameters.size()
+			&& fwrite(payload, 1, payload_length, file) == payload_length;
+
+	return fclose(file) == 0 && success;
+}
+
+gboolean on_export_finished(gpointer user_data) {
+	ExportJob *job = (ExportJob*) user_data;
+	ChData *data = job->data;
+	gchar *status_message;
+
+	if(job->success) {
+		status_message = g_strdup_printf("Disparity exported to %s in %.1lf milliseconds", job->filename.c_str(), job->elapsed);
+	} else {
+		status_message = g_strdup_printf("Could not export disparity to %s", job->filename.c_str());
+	}
+
+	show_status_message(data, status_message);
+	g_free(status_message);
+
+	delete job;
+	return FALSE;
+}
+
+void export_thread(gpointer job_data, gpointer user_data) {
+	ExportJob *job = (ExportJob*) job_data;
+	DisparityExporter *exporter = job->exporter;
+
+	gint64 start = g_get_monotonic_time();
+
+	if(job->format == EXPORT_PNG) {
+		job->success = write_disparity_png(job);
+	} else {
+		job->success = write_disparity_container(job);
+	}
+
+	job->elapsed = (g_get_monotonic_time() - start)/1000.0;
+
+	if(!job->success) {
+		fprintf(stderr, "WARNING: could not export disparity to %s\n", job->filename.c_str());
+	}
+
+	//Free the slot before handing the job to the interface:
+	g_mutex_lock(&exporter->mutex);
+	exporter->pending--;
+	g_cond_signal(&exporter->cond);
+	g_mutex_unlock(&exporter->mutex);
+
+	if(job->notify || !job->success) {
+		job->disparity.release();
+		g_idle_add(on_export_finished, job);
+	} else {
+		delete job;
+	}
+}
+
+DisparityExporter *disparity_exporter_new(int capacity) {
+	DisparityExporter *exporter = new DisparityExporter();
+	exporter->pending = 0;
+	exporter->capacity = MAX(capacity, 1);
+	g_mutex_init(&exporter->mutex);
+	g_cond_init(&exporter->cond);
+	exporter->pool = g_thread_pool_new(export_thread, exporter,
+			MAX((int) g_get_num_processors()/2, 1), FALSE, NULL);
+	return exporter;
+}
+
+/* Waits for the queued exports to be written */
+void disparity_exporter_free(DisparityExporter *exporter) {
+	g_thread_pool_free(exporter->pool, FALSE, TRUE);
+	g_cond_clear(&exporter->cond);
+	g_mutex_clear(&exporter->mutex);
+	delete exporter;
+}
+
+/* Queues a copy of the current disparity, blocking while the queue is full */
+void export_disparity(ChData *data, const string &filename, ExportFormat format, bool notify) {
+	DisparityExporter *exporter = data->exporter;
+
+	g_mutex_lock(&exporter->mutex);
+
+	while(exporter->pending >= exporter->capacity) {
+		g_cond_wait(&exporter->cond, &exporter->mutex);
+	}
+
+	exporter->pending++;
+	g_mutex_unlock(&exporter->mutex);
+
+	ExportJob *job = new ExportJob();
+	job->exporter = exporter;
+	job->data = data;
+	job->disparity = data->cv_image_disparity.clone();
+	job->q = data->q;
+	job->filename = filename;
+	job->parameters = describe_parameters(data);
+	job->format = format;
+	job->notify = notify;
+	job->success = false;
+	job->elapsed = 0;
+
+	g_thread_pool_push(exporter->pool, job, NULL);
+}
+
+RuntimeFeatures runtime_features(ChData *data) {
+	RuntimeFeatures features;
+	features.bucket = (data->matcher_type == BM ? 0 : 1 + data->mode)*2 + (data->hierarchical ? 1 : 0);
+	features.area = (double) data->cv_image_left.cols*data->cv_image_left.rows;
+	features.num_disparities = data->num_disparities;
+	features.block_size = data->block_size;
+	features.threads = MAX(getNumThreads(), 1);
+	return features;
+}
+
+double runtime_work(const RuntimeFeatures &features) {
+	return features.area*features.num_disparities/features.threads;
+}
+
+void runtime_model_add(RuntimeModel &model, const RuntimeFeatures &features, double runtime) {
+	if((int) model.buckets.size() <= features.bucket) {
+		model.buckets.resize(features.bucket + 1);
+	}
+
+	vector<RuntimeModel::Sample> &samples = model.buckets[features.bucket];
+	RuntimeModel::Sample sample = { runtime_work(features), (double) features.block_size, runtime };
+
+	if(samples.size() >= RuntimeModel::MAX_SAMPLES) {
+		samples.erase(samples.begin());
+	}
+	samples.push_back(sample);
+}
+
+/* Predicted runtime in milliseconds, false if nothing was observed for this bucket yet */
+bool runtime_model_predict(const RuntimeModel &model, const RuntimeFeatures &features, double &runtime) {
+	if((int) model.buckets.size() <= features.bucket || model.buckets[features.bucket].empty()) {
+		return false;
+	}
+
+	const vector<RuntimeModel::Sample> &samples = model.buckets[features.bucket];
+	double work = runtime_work(features);
+	int n = samples.size();
+
+	if(n >= 3) {
+		Mat a(n, 3, CV_64F), b(n, 1, CV_64F), x;
+
+		for(int i = 0; i < n; i++) {
+			a.at<double>(i, 0) = 1;
+			a.at<double>(i, 1) = samples[i].work;
+			a.at<double>(i, 2) = samples[i].work*samples[i].block_size;
+			b.at<double>(i, 0) = samples[i].runtime;
+		}
+
+		if(solve(a, b, x, DECOMP_SVD)) {
+			runtime = x.at<double>(0, 0) + x.at<double>(1, 0)*work + x.at<double>(2, 0)*work*features.block_size;
+
+			if(runtime > 0) {
+				return true;
+			}
+		}
+	}
+
+	//Too few or degenerate samples, assume the runtime is proportional to the work:
+	vector<double> ratios;
+
+	for(int i = 0; i < n; i++) {
+		if(samples[i].work > 0) {
+			ratios.push_back(samples[i].runtime/samples[i].work);
+		}
+	}
+
+	runtime = percentile(ratios, 0.5)*work;
+	return !ratios.empty();
+}
+
+/* Allocation instrumentation */
+
+static volatile gint instrumenting = 0;
+
+//Per thread, so that nothing the background threads allocate is charged to an update:
+static thread_local AllocationCounters allocation_counters;
+
+//Set while OpenCV's allocator runs, whose own bookkeeping is part of the Mat allocation:
+static thread_local bool allocating_mat = false;
+
+AllocationCounters read_allocation_counters() {
+	return allocation_counters;
+}
+
+/* Charges the calling thread with what another thread allocated between before and after */
+void add_allocations(const AllocationCounters &before, const AllocationCounters &after) {
+	allocation_counters.mat_allocations += after.mat_allocations - before.mat_allocations;
+	allocation_counters.mat_bytes += after.mat_bytes - before.mat_bytes;
+	allocation_counters.heap_allocations += after.heap_allocations - before.heap_allocations;
+	allocation_counters.heap_bytes += after.heap_bytes - before.heap_bytes;
+}
+
+void count_allocation(gsize *allocations, gsize *bytes, size_t size) {
+	if(g_atomic_int_get(&instrumenting)) {
+		(*allocations)++;
+		*bytes += size;
+	}
+}
+
+void *operator new(size_t size) {
+	if(!allocating_mat) {
+		count_allocation(&allocation_counters.heap_allocations, &allocation_counters.heap_bytes, size);
+	}
+
+	void *pointer = malloc(size > 0 ? size : 1);
+
+	if(pointer == NULL) {
+		throw bad_alloc();
+	}
+
+	return pointer;
+}
+
+void *operator new[](size_t size) {
+	return operator new(size);
+}
+
+void operator delete(void *pointer) noexcept {
+	free(pointer);
+}
+
+void operator delete[](void *pointer) noexcept {
+	free(pointer);
+}
+
+/* Counts the Mat buffers, leaving the actual work to OpenCV's allocator */
+class CountingAllocator : public MatAllocator {
+public:
+	CountingAllocator() : allocator(Mat::getStdAllocator()) {}
+
+	UMatData *allocate(int dims, const int *sizes, int type, void *data, size_t *step, int flags, UMatUsageFlags usage_flags) const {
+		UMatData *u;
+		allocating_mat = true;
+
+		try {
+			u = allocator->allocate(dims, sizes, type, data, step, flags, usage_flags);
+		} catch(...) {
+			allocating_mat = false;
+			throw;
+		}
+
+		allocating_mat = false;
+
+		if(u != NULL) {
+			//Mats wrapping user data don't allocate anything:
+			if(data == NULL) {
+				count_allocation(&allocation_counters.mat_allocations, &allocation_counters.mat_bytes, u->size);
+			}
+
+			u->currAllocator = this;
+		}
+
+		return u;
+	}
+
+	bool allocate(UMatData *u, int access_flags, UMatUsageFlags usage_flags) const {
+		return allocator->allocate(u, access_flags, usage_flags);
+	}
+
+	void deallocate(UMatData *u) const {
+		allocator->deallocate(u);
+	}
+
+private:
+	MatAllocator *allocator;
+};
+
+void start_instrumentation() {
+	static CountingAllocator counting_allocator;
+	Mat::setDefaultAllocator(&counting_allocator);
+	g_atomic_int_set(&instrumenting, 1);
+}
+
+/* Current and peak resident set size in kilobytes, false where /proc is not available */
+bool read_rss(long &rss, long &peak) {
+	FILE *status = fopen("/proc/self/status", "r");
+
+	if(status == NULL) {
+		return false;
+	}
+
+	char line[256];
+	rss = peak = -1;
+
+	while(fgets(line, sizeof(line), status) != NULL) {
+		sscanf(line, "VmRSS: %ld", &rss);
+		sscanf(line, "VmHWM: %ld", &peak);
+	}
+
+	fclose(status);
+	return rss >= 0 && peak >= 0;
+}
+
+/* Describes what was allocated between before and after on the status message, and on the session log if recording:
+ * memory <Mat allocations> <Mat bytes> <other allocations> <other bytes> <RSS kB> <peak RSS kB> */
+void report_allocations(ChData *data, const AllocationCounters &before, const AllocationCounters &after, GString *status_message) {
+	gsize mat_allocations = after.mat_allocations - before.mat_allocations;
+	gsize mat_bytes = after.mat_bytes - before.mat_bytes;
+	gsize heap_allocations = after.heap_allocations - before.heap_allocations;
+	gsize heap_bytes = after.heap_bytes - before.heap_bytes;
+
+	if(mat_allocations == 0 && heap_allocations == 0) {
+		g_string_append(status_message, ", no allocations");
+	} else {
+		g_string_append_printf(status_message, ", %lu Mat allocations (%.1lf kB) and %lu others (%.1lf kB)",
+				(unsigned long) mat_allocations, mat_bytes/1024.0, (unsigned long) heap_allocations, heap_bytes/1024.0);
+	}
+
+	long rss = 0, peak = 0;
+
+	if(read_rss(rss, peak)) {
+		g_string_append_printf(status_message, ", RSS %.1lf MB (%+ld kB, peak %.1lf MB)",
+				rss/1024.0, data->previous_rss > 0 ? rss - data->previous_rss : 0, peak/1024.0);
+		data->previous_rss = rss;
+	}
+
+	if(data->session_log != NULL) {
+		fprintf(data->session_log, "memory %lu %lu %lu %lu %ld %ld\n", (unsigned long) mat_allocations, (unsigned long) mat_bytes,
+				(unsigned long) heap_allocations, (unsigned long) heap_bytes, rss, peak);
+		fflush(data->session_log);
+	}
+}
+
+/* Shows a BGR image, rgb holds the pixels while they are displayed */
+void show_image(GtkImage *image, const Mat &bgr, Mat &rgb) {
+	cvtColor(bgr, rgb, CV_BGR2RGB);
+	GdkPixbuf *pixbuf = gdk_pixbuf_new_from_data(
+			(guchar*) rgb.data, GDK_COLORSPACE_RGB, false,
+			8, rgb.cols,
+			rgb.rows, rgb.step,
+			NULL, NULL);
+	gtk_image_set_from_pixbuf(image, pixbuf);
+}
+
+void show_disparity(ChData *data) {
+	normalize(data->cv_image_disparity, data->cv_image_disparity_normalized, 0,
+			255, CV_MINMAX, CV_8UC1);
+	cvtColor(data->cv_image_disparity_normalized, data->cv_color_image,
+			CV_GRAY2RGB);
+	GdkPixbuf *pixbuf = gdk_pixbuf_new_from_data(
+			(guchar*) data->cv_color_image.data, GDK_COLORSPACE_RGB, false,
+			8, data->cv_color_image.cols,
+			data->cv_color_image.rows, data->cv_color_image.step,
+			NULL, NULL);
+	gtk_image_set_from_pixbuf(data->image_depth, pixbuf);
+}
+
+/* Sequence timeline */
+
+/* Disparities of a sequence, stored in a memory-mapped temporary file. Each
+ * frame gets a page-aligned slot the first time it is stored, which is only
+ * mapped while being read or written, so memory stays bounded regardless of
+ * the sequence length. A frame that outgrows its slot gives it up for the
+ * others, so the file stops growing once the largest frames have one. Entries remember the generation of the parameters
+ * they were computed with, so invalidating the whole cache is free. */
+class DisparityCache {
+public:
+	DisparityCache(int frames);
+	~DisparityCache();
+
+	bool is_open() const { return fd >= 0; }
+
+	/* Whether the frame holds a disparity computed with the given generation */
+	bool has(int frame, gint generation);
+	int count(gint generation);
+
+	/* Copies the disparity out of the cache, false if it is not there */
+	bool get(int frame, gint generation, Mat &disparity);
+
+	/* Stores a CV_16S disparity, unless a newer generation is already there */
+	bool put(int frame, gint generation, const Mat &disparity);
+
+private:
+	struct Entry {
+		off_t offset; /* -1 until the first time the frame is stored */
+		size_t capacity; /* Size of the slot, a whole number of pages */
+		size_t length;
+		int width;
+		int height;
+		gint generation; /* -1 if the frame holds nothing */
+	};
+
+	struct Slot {
+		off_t offset;
+		size_t capacity;
+	};
+
+	GMutex mutex;
+	int fd;
+	off_t file_length;
+	size_t page_size;
+	vector<Entry> entries;
+	vector<Slot> free_slots; /* Slots given up by frames that outgrew them */
+};
+
+DisparityCache::DisparityCache(int frames) : file_length(0) {
+	g_mutex_init(&mutex);
+	page_size = sysconf(_SC_PAGESIZE);
+
+	Entry empty = { -1, 0, 0, 0, 0, -1 };
+	entries.assign(frames, empty);
+
+	//The file is removed right away and disappears once it is closed:
+	gchar *filename = NULL;
+	fd = g_file_open_tmp("stereo-tuner-XXXXXX.cache", &filename, NULL);
+
+	if(fd >= 0) {
+		unlink(filename);
+	}
+	g_free(filename);
+}
+
+DisparityCache::~DisparityCache() {
+	if(fd >= 0) {
+		close(fd);
+	}
+	g_mutex_clear(&mutex);
+}
+
+bool DisparityCache::has(int frame, gint generation) {
+	g_mutex_lock(&mutex);
+	bool found = entries[frame].generation == generation;
+	g_mutex_unlock(&mutex);
+	return found;
+}
+
+int DisparityCache::count(gint generation) {
+	int cached = 0;
+
+	g_mutex_lock(&mutex);
+
+	for(size_t i = 0; i < entries.size(); i++) {
+		if(entries[i].generation == generation) {
+			cached++;
+		}
+	}
+
+	g_mutex_unlock(&mutex);
+	return cached;
+}
+
+bool DisparityCache::get(int frame, gint generation, Mat &disparity) {
+	g_mutex_lock(&mutex);
+	Entry &entry = entries[frame];
+
+	if(entry.generation != generation) {
+		g_mutex_unlock(&mutex);
+		return false;
+	}
+
+	void *mapping = mmap(NULL, entry.length, PROT_READ, MAP_SHARED, fd, entry.offset);
+
+	if(mapping == MAP_FAILED) {
+		g_mutex_unlock(&mutex);
+		return false;
+	}
+
+	Mat(entry.height, entry.width, CV_16S, mapping).copyTo(disparity);
+	munmap(mapping, entry.length);
+	g_mutex_unlock(&mutex);
+	return true;
+}
+
+bool DisparityCache::put(int frame, gint generation, const Mat &disparity) {
+	if(fd < 0 || disparity.type() != CV_16S) {
+		return false;
+	}
+
+	g_mutex_lock(&mutex);
+	Entry &entry = entries[frame];
+	size_t length = disparity.cols*disparity.rows*sizeof(short);
+
+	if(entry.generation > generation) {
+		g_mutex_unlock(&mutex);
+		return false;
+	}
+
+	//Frames keep their slot while they fit in it, then take a free one or grow the file:
+	if(entry.offset < 0 || entry.capacity < length) {
+		size_t capacity = ((length + page_size - 1)/page_size)*page_size;
+		size_t best = free_slots.size();
+
+		for(size_t i = 0; i < free_slots.size(); i++) {
+			if(free_slots[i].capacity >= capacity && (best == free_slots.size() || free_slots[i].capacity < free_slots[best].capacity)) {
+				best = i;
+			}
+		}
+
+		Slot chosen;
+
+		if(best < free_slots.size()) {
+			chosen = free_slots[best];
+			free_slots.erase(free_slots.begin() + best);
+		} else {
+			if(ftruncate(fd, file_length + capacity) != 0) {
+				g_mutex_unlock(&mutex);
+				return false;
+			}
+
+			chosen.offset = file_length;
+			chosen.capacity = capacity;
+			file_length += capacity;
+		}
+
+		if(entry.offset >= 0) {
+			Slot previous = { entry.offset, entry.capacity };
+			free_slots.push_back(previous);
+		}
+
+		entry.offset = chosen.offset;
+		entry.capacity = chosen.capacity;
+	}
+
+	entry.length = length;
+
+	void *mapping = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, entry.offset);
+
+	if(mapping == MAP_FAILED) {
+		entry.generation = -1;
+		g_mutex_unlock(&mutex);
+		return false;
+	}
+
+	Mat slot(disparity.rows, disparity.cols, CV_16S, mapping);
+	disparity.copyTo(slot);
+	munmap(mapping, length);
+
+	entry.width = disparity.cols;
+	entry.height = disparity.rows;
+	entry.generation = generation;
+	g_mutex_unlock(&mutex);
+	return true;
+}
+
+/* Keeps the disparities of every frame of a sequence up to date with the
+ * current parameters. A background thread computes the frames missing from
+ * the cache, starting with the ones closest to the cursor. */
+struct SequenceTimeline {
+	ChData *data;
+	vector<DatasetPair> frames;
+	vector<bool> unreadable;
+	DisparityCache *cache;
+	GThread *thread;
+	GMutex mutex;
+	GCond cond;
+	Ptr<StereoMatcher> matcher; /* Matcher for the current parameters, empty once every frame is cached */
+	volatile gint generation;
+	volatile gint cursor;
+	bool quit;
+};
+
+struct TimelineReport {
+	ChData *data;
+	int frame;
+	gint generation;
+};
+
+void show_cache_status(ChData *data) {
+	SequenceTimeline *timeline = data->timeline;
+	gint generation = g_atomic_int_get(&timeline->generation);
+	gchar *text = g_strdup_printf("Frame %d/%d, %d cached", data->current_frame + 1,
+			(int) timeline->frames.size(), timeline->cache->count(generation));
+	gtk_label_set_text(data->lbl_cache, text);
+	g_free(text);
+}
+
+gboolean on_timeline_frame_ready(gpointer user_data) {
+	TimelineReport *report = (TimelineReport*) user_data;
+	ChData *data = report->data;
+	SequenceTimeline *timeline = data->timeline;
+
+	if(report->generation == g_atomic_int_get(&timeline->generation)) {
+		if(report->frame == data->current_frame
+				&& timeline->cache->get(report->frame, report->generation, data->cv_image_disparity)) {
+			show_disparity(data);
+		}
+		show_cache_status(data);
+	}
+
+	delete report;
+	return FALSE;
+}
+
+/* The frame missing from the cache closest to the cursor, -1 if there is none.
+ * Must be called with the timeline mutex held. */
+int timeline_next_frame(SequenceTimeline *timeline, gint generation) {
+	int frames = timeline->frames.size();
+	int cursor = g_atomic_int_get(&timeline->cursor);
+
+	for(int distance = 0; distance < frames; distance++) {
+		int candidates[2] = { cursor - distance, cursor + distance };
+
+		for(int i = 0; i < (distance == 0 ? 1 : 2); i++) {
+			int frame = candidates[i];
+
+			if(frame >= 0 && frame < frames && !timeline->unreadable[frame]
+					&& !timeline->cache->has(frame, generation)) {
+				return frame;
+			}
+		}
+	}
+
+	return -1;
+}
+
+gpointer timeline_thread(gpointer user_data) {
+	SequenceTimeline *timeline = (SequenceTimeline*) user_data;
+	ChData *data = timeline->data;
+	Mat left, right, disparity;
+
+	for(;;) {
+		g_mutex_lock(&timeline->mutex);
+
+		while(!timeline->quit && timeline->matcher.empty()) {
+			g_cond_wait(&timeline->cond, &timeline->mutex);
+		}
+
+		if(timeline->quit) {
+			g_mutex_unlock(&timeline->mutex);
+			break;
+		}
+
+		Ptr<StereoMatcher> matcher = timeline->matcher;
+		gint generation = timeline->generation;
+		int frame = timeline_next_frame(timeline, generation);
+
+		if(frame < 0) {
+			timeline->matcher.release();
+			g_mutex_unlock(&timeline->mutex);
+			continue;
+		}
+
+		g_mutex_unlock(&timeline->mutex);
+
+		const DatasetPair &pair = timeline->frames[frame];
+		left = imread(pair.left_filename, IMREAD_GRAYSCALE);
+		right = imread(pair.right_filename, IMREAD_GRAYSCALE);
+
+		if(left.empty() || right.empty() || left.size() != right.size()) {
+			fprintf(stderr, "WARNING: could not read frame %s, %s\n",
+					pair.left_filename.c_str(), pair.right_filename.c_str());
+			g_mutex_lock(&timeline->mutex);
+			timeline->unreadable[frame] = true;
+			g_mutex_unlock(&timeline->mutex);
+			continue;
+		}
+
+		rectify_image(data, left, true);
+		rectify_image(data, right, false);
+		matcher->compute(left, right, disparity);
+
+		if(timeline->cache->put(frame, generation, disparity)) {
+			TimelineReport *report = new TimelineReport();
+			report->data = data;
+			report->frame = frame;
+			report->generation = generation;
+			g_idle_add(on_timeline_frame_ready, report);
+		}
+	}
+
+	return NULL;
+}
+
+SequenceTimeline *timeline_new(ChData *data, const vector<DatasetPair> &frames) {
+	SequenceTimeline *timeline = new SequenceTimeline();
+	timeline->data = data;
+	timeline->frames = frames;
+	timeline->unreadable.assign(frames.size(), false);
+	timeline->cache = new DisparityCache(frames.size());
+	timeline->generation = 0;
+	timeline->cursor = 0;
+	timeline->quit = false;
+	g_mutex_init(&timeline->mutex);
+	g_cond_init(&timeline->cond);
+	timeline->thread = g_thread_new("timeline", timeline_thread, timeline);
+	return timeline;
+}
+
+void timeline_free(SequenceTimeline *timeline) {
+	g_mutex_lock(&timeline->mutex);
+	timeline->quit = true;
+	g_cond_signal(&timeline->cond);
+	g_mutex_unlock(&timeline->mutex);
+
+	g_thread_join(timeline->thread);
+	g_cond_clear(&timeline->cond);
+	g_mutex_clear(&timeline->mutex);
+	delete timeline->cache;
+	delete timeline;
+}
+
+/* Invalidates the cache after a parameter change, stores the disparity just
+ * computed for the current frame and recomputes the others in the background */
+void timeline_update(ChData *data) {
+	SequenceTimeline *timeline = data->timeline;
+	Ptr<StereoMatcher> matcher = create_matcher(data);
+	apply_roi(data, matcher);
+
+	g_mutex_lock(&timeline->mutex);
+	g_atomic_int_inc(&timeline->generation);
+	timeline->cache->put(data->current_frame, timeline->generation, data->cv_image_disparity);
+	timeline->matcher = matcher;
+	g_cond_signal(&timeline->cond);
+	g_mutex_unlock(&timeline->mutex);
+
+	show_cache_status(data);
+}
+
+/* Multi-camera rigs */
+
+/* Path of a file named in a rig description, relative to the rig file, empty if not given */
+string rig_path(const gchar *directory, const FileNode &node) {
+	if(node.empty()) {
+		return string();
+	}
+
+	string path = (string) node;
+
+	if(path.empty() || g_path_is_absolute(path.c_str())) {
+		return path;
+	}
+
+	gchar *filename = g_build_filename(directory, path.c_str(), NULL);
+	path = filename;
+	g_free(filename);
+	return path;
+}
+
+ParameterValues get_parameters(ChData *data) {
+	ParameterValues parameters;
+	parameters.matcher_type = data->matcher_type;
+
+	for(int i = 0; i < SESSION_PARAMETER_COUNT; i++) {
+		parameters.values.push_back(data->*SESSION_PARAMETERS[i].field);
+	}
+
+	return parameters;
+}
+
+void set_parameters(ChData *data, const ParameterValues &parameters) {
+	data->matcher_type = parameters.matcher_type;
+
+	for(int i = 0; i < SESSION_PARAMETER_COUNT; i++) {
+		data->*SESSION_PARAMETERS[i].field = parameters.values[i];
+	}
+}
+
+/* Reads the values found in a saved parameters file as overrides of a pair */
+bool read_overrides(const char *filename, RigPair &pair) {
+	FileStorage fs(filename, FileStorage::READ);
+
+	if(!fs.isOpened()) {
+		return false;
+	}
+
+	if(!fs["name"].empty()) {
+		string name = (string) fs["name"];
+		pair.parameters.matcher_type = name == "StereoMatcher.SGBM" ? SGBM : BM;
+		pair.matcher_type_overridden = true;
+	}
+
+	for(int i = 0; i < SESSION_PARAMETER_COUNT; i++) {
+		FileNode value = fs[SESSION_PARAMETERS[i].name];
+
+		if(!value.empty()) {
+			pair.parameters.values[i] = (int) value;
+			pair.overridden[i] = true;
+		}
+	}
+
+	return true;
+}
+
+/* Names of the parameters overridden by a pair, empty if it has none */
+string describe_overrides(const RigPair &pair) {
+	string description = pair.matcher_type_overridden ? "algorithm" : "";
+
+	for(int i = 0; i < SESSION_PARAMETER_COUNT; i++) {
+		if(pair.overridden[i]) {
+			description += description.empty() ? "" : ", ";
+			description += SESSION_PARAMETERS[i].name;
+		}
+	}
+
+	return description;
+}
+
+/* Reads a rig description, a YAML or XML file with one entry per stereo pair:
+ *
+ *   pairs:
+ *     - { name: front, left: front_left.png, right: front_right.png,
+ *         intrinsics: front_intrinsics.yml, extrinsics: front_extrinsics.yml,
+ *         parameters: front_params.yml }
+ *
+ * Calibration and parameters files are optional. The parameters file has the
+ * format written by the Save button, the values found there override the
+ * shared ones for that pair only. Errors are printed. */
+bool load_rig(const char *filename, vector<RigPair> &pairs) {
+	FileStorage fs(filename, FileStorage::READ);
+
+	if(!fs.isOpened()) {
+		printf("Could not open rig file %s.\n", filename);
+		return false;
+	}
+
+	FileNode nodes = fs["pairs"];
+
+	if(!nodes.isSeq() || nodes.size() == 0) {
+		printf("Rig file %s does not list any pair.\n", filename);
+		return false;
+	}
+
+	gchar *directory = g_path_get_dirname(filename);
+	bool success = true;
+
+	for(FileNodeIterator it = nodes.begin(); it != nodes.end(); ++it) {
+		FileNode node = *it;
+		RigPair pair;
+		pair.parameters.matcher_type = BM;
+		pair.parameters.values.assign(SESSION_PARAMETER_COUNT, 0);
+		pair.matcher_type_overridden = false;
+		pair.overridden.assign(SESSION_PARAMETER_COUNT, false);
+
+		char default_name[32];
+		snprintf(default_name, sizeof(default_name), "Pair %d", (int) pairs.size() + 1);
+		pair.name = node["name"].empty() ? string(default_name) : (string) node["name"];
+
+		string intrinsics_filename = rig_path(directory, node["intrinsics"]);
+		string extrinsics_filename = rig_path(directory, node["extrinsics"]);
+		string parameters_filename = rig_path(directory, node["parameters"]);
+
+		pair.left_image = imread(rig_path(directory, node["left"]), 1);
+		pair.right_image = imread(rig_path(directory, node["right"]), 1);
+
+		if(pair.left_image.empty() || pair.right_image.empty()) {
+			printf("Could not read the images of pair %s.\n", pair.name.c_str());
+			success = false;
+			break;
+		}
+
+		if(pair.left_image.size() != pair.right_image.size()) {
+			printf("Left and right images of pair %s have different sizes.\n", pair.name.c_str());
+			success = false;
+			break;
+		}
+
+		pair.calibrated = !intrinsics_filename.empty() && !extrinsics_filename.empty();
+
+		if(pair.calibrated) {
+			if(!load_rectification(intrinsics_filename.c_str(), extrinsics_filename.c_str(), pair.left_image.size(), pair.rectification)) {
+				success = false;
+				break;
+			}
+
+			Mat remapped_left, remapped_right;
+			remap(pair.left_image, remapped_left, pair.rectification.map11, pair.rectification.map12, INTER_LINEAR);
+			remap(pair.right_image, remapped_right, pair.rectification.map21, pair.rectification.map22, INTER_LINEAR);
+			pair.left_image = remapped_left;
+			pair.right_image = remapped_right;
+		}
+
+		cvtColor(pair.left_image, pair.left, CV_BGR2GRAY);
+		cvtColor(pair.right_image, pair.right, CV_BGR2GRAY);
+
+		if(!parameters_filename.empty() && !read_overrides(parameters_filename.c_str(), pair)) {
+			printf("Could not open parameters file %s of pair %s.\n", parameters_filename.c_str(), pair.name.c_str());
+			success = false;
+			break;
+		}
+
+		pair.elapsed = 0;
+		pair.thread = NULL;
+		pair.label = NULL;
+		pairs.push_back(pair);
+	}
+
+	g_free(directory);
+	return success;
+}
+
+/* Gives the shared values to the parameters not overridden by each pair */
+void share_rig_parameters(ChData *data) {
+	for(size_t p = 0; p < data->rig.size(); p++) {
+		RigPair &pair = data->rig[p];
+
+		if(!pair.matcher_type_overridden) {
+			pair.parameters.matcher_type = data->rig_shared.matcher_type;
+		}
+
+		for(int i = 0; i < SESSION_PARAMETER_COUNT; i++) {
+			if(!pair.overridden[i]) {
+				pair.parameters.values[i] = data->rig_shared.values[i];
+			}
+		}
+	}
+}
+
+/* Stores the values on the interface, which are those of the selected pair:
+ * the ones it overrides only change for it, the others for all pairs */
+void sync_rig_parameters(ChData *data) {
+	RigPair &selected = data->rig[data->rig_pair];
+	ParameterValues current = get_parameters(data);
+
+	if(selected.matcher_type_overridden) {
+		selected.parameters.matcher_type = current.matcher_type;
+	} else {
+		data->rig_shared.matcher_type = current.matcher_type;
+	}
+
+	for(int i = 0; i < SESSION_PARAMETER_COUNT; i++) {
+		if(selected.overridden[i]) {
+			selected.parameters.values[i] = current.values[i];
+		} else {
+			data->rig_shared.values[i] = current.values[i];
+		}
+	}
+
+	share_rig_parameters(data);
+}
+
+/* Makes a pair of the rig the one shown and used by the rest of the tuner, parameters included */
+void use_rig_pair(ChData *data, int index) {
+	RigPair &pair = data->rig[index];
+
+	set_parameters(data, pair.parameters);
+	data->rig_pair = index;
+	data->cv_image_left = pair.left;
+	data->cv_image_right = pair.right;
+	data->cv_image_disparity = pair.disparity;
+	data->q = pair.rectification.q;
+	data->map11 = pair.rectification.map11;
+	data->map12 = pair.rectification.map12;
+	data->map21 = pair.rectification.map21;
+	data->map22 = pair.rectification.map22;
+	data->roi1 = pair.calibrated ? &pair.rectification.roi1 : NULL;
+	data->roi2 = pair.calibrated ? &pair.rectification.roi2 : NULL;
+}
+
+/* Brings the matcher of every pair up to date with its parameters, which are
+ * put in data only while configuring it */
+void configure_rig(ChData *data) {
+	for(size_t p = 0; p < data->rig.size(); p++) {
+		RigPair &pair = data->rig[p];
+		set_parameters(data, pair.parameters);
+
+		if(matcher_is_current(data, pair.matcher)) {
+			configure_matcher(data, pair.matcher);
+		} else {
+			pair.matcher = create_matcher(data);
+		}
+
+		Ptr<StereoBM> stereo_bm = pair.matcher.dynamicCast<StereoBM>();
+
+		if(stereo_bm && pair.calibrated) {
+			stereo_bm->setROI1(pair.rectification.roi1);
+			stereo_bm->setROI2(pair.rectification.roi2);
+		}
+	}
+
+	set_parameters(data, data->rig[data->rig_pair].parameters);
+}
+
+/* Matches one pair of the rig */
+gpointer rig_pair_thread(gpointer user_data) {
+	RigPair *pair = (RigPair*) user_data;
+	pair->allocations_before = read_allocation_counters();
+	gint64 start = g_get_monotonic_time();
+	pair->matcher->compute(pair->left, pair->right, pair->disparity);
+	pair->elapsed = (g_get_monotonic_time() - start)/1000.0;
+	pair->allocations_after = read_allocation_counters();
+	return NULL;
+}
+
+/* Matches every pair of the rig at the same time, so the total time
+ * approaches the one of the slowest pair instead of their sum. Returns the
+ * time of the slowest pair, in milliseconds. */
+double compute_rig(ChData *data) {
+	configure_rig(data);
+
+	//Plain threads, inside parallel_for_ the parallel loops of each matcher would run serially:
+	for(size_t p = 1; p < data->rig.size(); p++) {
+		data->rig[p].thread = g_thread_new("rig", rig_pair_thread, &data->rig[p]);
+	}
+
+	rig_pair_thread(&data->rig[0]);
+
+	double slowest = data->rig[0].elapsed;
+
+	//The first pair was already counted on this thread:
+	for(size_t p = 1; p < data->rig.size(); p++) {
+		RigPair &pair = data->rig[p];
+		g_thread_join(pair.thread);
+		pair.thread = NULL;
+		add_allocations(pair.allocations_before, pair.allocations_after);
+		slowest = MAX(slowest, pair.elapsed);
+	}
+
+	return slowest;
+}
+
+/* Shows the size, time and parameters of every pair on its tab */
+void show_rig_times(ChData *data) {
+	for(size_t p = 0; p < data->rig.size(); p++) {
+		RigPair &pair = data->rig[p];
+
+		if(pair.label != NULL) {
+			string overrides = describe_overrides(pair);
+			gchar *text = g_strdup_printf("%s: %dx%d, %.1lf milliseconds, %s%s", pair.name.c_str(),
+					pair.left.cols, pair.left.rows, pair.elapsed,
+					overrides.empty() ? "shared parameters" : "own values for ", overrides.c_str());
+			gtk_label_set_text(pair.label, text);
+			g_free(text);
+		}
+	}
+
+}
+
+/* Enables the parameters used by the selected algorithm */
+void update_sensitivity(ChData *data) {
+	switch (data->matcher_type) {
+	case BM:
+		gtk_widget_set_sensitive(data->sc_block_size, true);
+		gtk_widget_set_sensitive(data->sc_min_disparity, true);
+		gtk_widget_set_sensitive(data->sc_num_disparities, true);
+		gtk_widget_set_sensitive(data->sc_disp_max_diff, true);
+		gtk_widget_set_sensitive(data->sc_speckle_range, true);
+		gtk_widget_set_sensitive(data->sc_speckle_window_size, true);
+		gtk_widget_set_sensitive(data->sc_p1, false);
+		gtk_widget_set_sensitive(data->sc_p2, false);
+		gtk_widget_set_sensitive(data->sc_pre_filter_cap, true);
+		gtk_widget_set_sensitive(data->sc_pre_filter_size, true);
+		gtk_widget_set_sensitive(data->sc_uniqueness_ratio, true);
+		gtk_widget_set_sensitive(data->sc_texture_threshold, true);
+		gtk_widget_set_sensitive(data->rb_pre_filter_normalized, true);
+		gtk_widget_set_sensitive(data->rb_pre_filter_xsobel, true);
+		gtk_widget_set_sensitive(data->chk_full_dp, false);
+		break;
+
+	case SGBM:
+		gtk_widget_set_sensitive(data->sc_block_size, true);
+		gtk_widget_set_sensitive(data->sc_min_disparity, true);
+		gtk_widget_set_sensitive(data->sc_num_disparities, true);
+		gtk_widget_set_sensitive(data->sc_disp_max_diff, true);
+		gtk_widget_set_sensitive(data->sc_speckle_range, true);
+		gtk_widget_set_sensitive(data->sc_speckle_window_size, true);
+		gtk_widget_set_sensitive(data->sc_p1, true);
+		gtk_widget_set_sensitive(data->sc_p2, true);
+		gtk_widget_set_sensitive(data->sc_pre_filter_cap, true);
+		gtk_widget_set_sensitive(data->sc_pre_filter_size, false);
+		gtk_widget_set_sensitive(data->sc_uniqueness_ratio, true);
+		gtk_widget_set_sensitive(data->sc_texture_threshold, false);
+		gtk_widget_set_sensitive(data->rb_pre_filter_normalized, false);
+		gtk_widget_set_sensitive(data->rb_pre_filter_xsobel, false);
+		gtk_widget_set_sensitive(data->chk_full_dp, true);
+		break;
+	}
+}
+
+/* Shows the parameters on the interface without computing anything */
+void show_parameters(ChData *data) {
+	//Avoids rebuilding the matcher on every change:
+	data->live_update = false;
+
+	if(data->matcher_type == BM) {
+		gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(data->rb_bm),true);
+	} else {
+		gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(data->rb_sgbm),true);
+	}
+
+	gtk_adjustment_set_value(data->adj_block_size,data->block_size);
+	gtk_adjustment_set_value(data->adj_min_disparity,data->min_disparity);
+	gtk_adjustment_set_value(data->adj_num_disparities,data->num_disparities);
+	gtk_adjustment_set_value(data->adj_disp_max_diff,data->disp_12_max_diff);
+	gtk_adjustment_set_value(data->adj_speckle_range,data->speckle_range);
+	gtk_adjustment_set_value(data->adj_speckle_window_size,data->speckle_window_size);
+	gtk_adjustment_set_value(data->adj_p1,data->p1);
+	gtk_adjustment_set_value(data->adj_p2,data->p2);
+	gtk_adjustment_set_value(data->adj_pre_filter_cap,data->pre_filter_cap);
+	gtk_adjustment_set_value(data->adj_pre_filter_size,data->pre_filter_size);
+	gtk_adjustment_set_value(data->adj_uniqueness_ratio,data->uniqueness_ratio);
+	gtk_adjustment_set_value(data->adj_texture_threshold,data->texture_threshold);
+	gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(data->chk_full_dp),data->mode == StereoSGBM::MODE_HH);
+	gtk_adjustment_set_value(data->adj_band_height,data->band_height);
+	gtk_adjustment_set_value(data->adj_band_margin,data->band_margin);
+	gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(data->chk_hierarchical),data->hierarchical != 0);
+
+	if(data->pre_filter_type == StereoBM::PREFILTER_NORMALIZED_RESPONSE) {
+		gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(data->rb_pre_filter_normalized),true);
+	} else {
+		gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(data->rb_pre_filter_xsobel),true);
+	}
+
+	gtk_widget_set_sensitive(data->sc_band_height, data->hierarchical != 0);
+	gtk_widget_set_sensitive(data->sc_band_margin, data->hierarchical != 0);
+	update_sensitivity(data);
+	data->live_update = true;
+}
+
+void update_matcher(ChData *data) {
+	if(!data->live_update) {
+		return;
+	}
+
+	RuntimeFeatures features = runtime_features(data);
+	double predicted = 0;
+	bool has_prediction = runtime_model_predict(data->runtime_model, features, predicted);
+
+	//Go back to the values of the disparity shown, so the interface matches it:
+	if(has_prediction && data->max_runtime > 0 && predicted > data->max_runtime*1000) {
+		if(!data->rig.empty()) {
+			set_parameters(data, data->rig[data->rig_pair].parameters);
+			show_parameters(data);
+		} else if(!data->computed_parameters.values.empty()) {
+			set_parameters(data, data->computed_parameters);
+			show_parameters(data);
+		}
+
+		gchar *status_message = g_strdup_printf("Not computing, predicted to take %.1lf seconds (limit is %.1lf seconds), parameters restored",
+				predicted/1000, data->max_runtime);
+		show_status_message(data, status_message);
+		g_free(status_message);
+		return;
+	}
+
+	if(!data->rig.empty()) {
+		sync_rig_parameters(data);
+	}
+
+	//Only configuring and matching count, the bookkeeping of the tuner itself does not:
+	AllocationCounters allocations_before = read_allocation_counters();
+
+	switch (data->matcher_type) {
+	case BM:
+		//If we have the wrong type of matcher, let's create a new one:
+		if (!matcher_is_current(data)) {
+			data->stereo_matcher = create_matcher(data);
+			update_sensitivity(data);
+		}
+
+		apply_roi(data, data->stereo_matcher);
+		break;
+
+	case SGBM:
+		//If we have the wrong type of matcher, let's create a new one:
+		if (!matcher_is_current(data)) {
+			data->stereo_matcher = create_matcher(data);
+			update_sensitivity(data);
+		}
+		break;
+	}
+
+	configure_matcher(data, data->stereo_matcher);
+
+	//Wall clock time, clock() would also count the background threads:
+	gint64 start = g_get_monotonic_time();
+	double slowest = 0;
+
+	if(data->rig.empty()) {
+		data->stereo_matcher->compute(data->cv_image_left, data->cv_image_right,
+				data->cv_image_disparity);
+	} else {
+		slowest = compute_rig(data);
+		data->cv_image_disparity = data->rig[data->rig_pair].disparity;
+	}
+
+	double elapsed = (g_get_monotonic_time() - start)/1000.0;
+	AllocationCounters allocations_after = read_allocation_counters();
+
+	if(!data->rig.empty()) {
+		show_rig_times(data);
+	}
+
+	//Rig pairs are timed while the others run, which says little about a single computation:
+	if(data->rig.empty()) {
+		runtime_model_add(data->runtime_model, features, elapsed);
+		data->computed_parameters = get_parameters(data);
+	}
+
+	if(data->session_log != NULL) {
+		session_record(data, start, elapsed);
+	}
+
+	GString *status_message = g_string_new(NULL);
+	g_string_append_printf(status_message, "Disparity computation took %lf milliseconds", elapsed);
+
+	if(!data->rig.empty()) {
+		g_string_append_printf(status_message, " for %d pairs, the slowest took %.1lf", (int) data->rig.size(), slowest);
+	}
+
+	if(has_prediction) {
+		g_string_append_printf(status_message, " (predicted %.1lf)", predicted);
+	}
+
+	if(data->frame_budget > 0 && elapsed > data->frame_budget) {
+		g_string_append_printf(status_message, ", over the %.1lf milliseconds budget", data->frame_budget);
+	}
+
+	show_disparity(data);
+
+	if(data->export_directory != NULL && data->rig.empty()) {
+		gchar *name = g_strdup_printf("disparity_%06d.%s", data->export_count++, export_format_extension(data->export_format));
+		gchar *filename = g_build_filename(data->export_directory, name, NULL);
+		export_disparity(data, filename, data->export_format, false);
+		g_free(filename);
+		g_free(name);
+	} else if(data->export_directory != NULL) {
+		//Every pair of the rig, named after it and with its own parameters in the header:
+		int selected = data->rig_pair;
+
+		for(size_t p = 0; p < data->rig.size(); p++) {
+			use_rig_pair(data, p);
+			gchar *name = g_strdup_printf("disparity_%06d_%s.%s", data->export_count, data->rig[p].name.c_str(), export_format_extension(data->export_format));
+			gchar *filename = g_build_filename(data->export_directory, name, NULL);
+			export_disparity(data, filename, data->export_format, false);
+			g_free(filename);
+			g_free(name);
+		}
+
+		data->export_count++;
+		use_rig_pair(data, selected);
+	}
+
+	if(data->timeline != NULL) {
+		timeline_update(data);
+	}
+
+	//The dataset gets its own matcher, since it is used from another thread:
+	if(data->dataset != NULL) {
+		dataset_evaluator_schedule(data->dataset, create_matcher(data));
+	}
+
+	if(data->instrument) {
+		report_allocations(data, allocations_before, allocations_after, status_message);
+	}
+
+	gtk_statusbar_pop(GTK_STATUSBAR(data->status_bar), data->message_status_context);
+	gtk_statusbar_pop(GTK_STATUSBAR(data->status_bar), data->status_bar_context);
+	gtk_statusbar_push(GTK_STATUSBAR(data->status_bar), data->status_bar_context, status_message->str);
+	g_string_free(status_message, TRUE);
+}
+
+void update_interface(ChData *data) {
+	show_parameters(data);
+	update_matcher(data);
+}
+
+/* Disparity range suggestion */
+
+static const int SUGGEST_RANGE_FEATURES = 2000;
+static const int SUGGEST_RANGE_MIN_MATCHES = 20;
+static const double SUGGEST_RANGE_MAX_ROW_ERROR = 1.0; /* Pixels, images are rectified */
+static const double SUGGEST_RANGE_OUTLIER_FRACTION = 0.02; /* Discarded on each side */
+static const int SUGGEST_RANGE_MARGIN = 2; /* Pixels added on each side */
+
+/* Matches ORB features between the rectified images and returns the
+ * tightest range holding their horizontal offsets, ignoring outliers.
+ * Returns the number of matches used, or 0 if there were not enough. */
+int suggest_disparity_range(const Mat &left, const Mat &right, int &min_disparity, int &max_disparity) {
+	Ptr<ORB> orb = ORB::create(SUGGEST_RANGE_FEATURES);
+	vector<KeyPoint> keypoints_left, keypoints_right;
+	Mat descriptors_left, descriptors_right;
+
+	orb->detectAndCompute(left, Mat(), keypoints_left, descriptors_left);
+	orb->detectAndCompute(right, Mat(), keypoints_right, descriptors_right);
+
+	if(keypoints_left.empty() || keypoints_right.empty()) {
+		return 0;
+	}
+
+	BFMatcher matcher(NORM_HAMMING, true);
+	vector<DMatch> matches;
+	matcher.match(descriptors_left, descriptors_right, matches);
+
+	//Histogram of the integer horizontal offsets of the matches on the same row:
+	int width = left.cols;
+	vector<int> histogram(2*width + 1, 0);
+	int count = 0;
+
+	for(size_t i = 0; i < matches.size(); i++) {
+		const Point2f &point_left = keypoints_left[matches[i].queryIdx].pt;
+		const Point2f &point_right = keypoints_right[matches[i].trainIdx].pt;
+
+		if(fabs(point_left.y - point_right.y) > SUGGEST_RANGE_MAX_ROW_ERROR) {
+			continue;
+		}
+
+		int offset = cvRound(point_left.x - point_right.x);
+		histogram[offset + width]++;
+		count++;
+	}
+
+	if(count < SUGGEST_RANGE_MIN_MATCHES) {
+		return 0;
+	}
+
+	int outliers = (int) (count*SUGGEST_RANGE_OUTLIER_FRACTION);
+	int low = 0, high = (int) histogram.size() - 1;
+
+	for(int discarded = histogram[low]; discarded <= outliers; discarded += histogram[++low]);
+	for(int discarded = histogram[high]; discarded <= outliers; discarded += histogram[--high]);
+
+	min_disparity = low - width - SUGGEST_RANGE_MARGIN;
+	max_disparity = high - width + SUGGEST_RANGE_MARGIN;
+	return count;
+}
+
+/* Writes the parameters in the format read by the read method of StereoBM or StereoSGBM */
+void write_parameters(FileStorage &fs, ChData *data) {
+	switch(data->matcher_type) {
+	case BM:
+		fs <<
+		"name" << "StereoMatcher.BM" <<
+		"blockSize" << data->block_size <<
+		"minDisparity" << data->min_disparity <<
+		"numDisparities" << data->num_disparities <<
+		"disp12MaxDiff" << data->disp_12_max_diff <<
+		"speckleRange" << data->speckle_range <<
+		"speckleWindowSize" << data->speckle_window_size <<
+		"preFilterCap" << data->pre_filter_cap <<
+		"preFilterSize" << data->pre_filter_size <<
+		"uniquenessRatio" << data->uniqueness_ratio <<
+		"textureThreshold" << data->texture_threshold <<
+		"preFilterType" << data->pre_filter_type <<
+		"hierarchical" << data->hierarchical <<
+		"bandHeight" << data->band_height <<
+		"bandMargin" << data->band_margin;
+		break;
+
+	case SGBM:
+		fs <<
+		"name" << "StereoMatcher.SGBM" <<
+		"blockSize" << data->block_size <<
+		"minDisparity" << data->min_disparity <<
+		"numDisparities" << data->num_disparities <<
+		"disp12MaxDiff" << data->disp_12_max_diff <<
+		"speckleRange" << data->speckle_range <<
+		"speckleWindowSize" << data->speckle_window_size <<
+		"P1" << data->p1 <<
+		"P2" << data->p2 <<
+		"preFilterCap" << data->pre_filter_cap <<
+		"uniquenessRatio" << data->uniqueness_ratio <<
+		"mode" << data->mode <<
+		"hierarchical" << data->hierarchical <<
+		"bandHeight" << data->band_height <<
+		"bandMargin" << data->band_margin;
+		break;
+	}
+}
+
+/* Compile-time specialized export */
+
+/* Lowercase C++11 keywords and alternative tokens, plus the namespaces the generated code uses */
+static const char *CODE_RESERVED_NAMES[] = {
+	"alignas", "alignof", "and", "and_eq", "asm", "auto", "bitand", "bitor", "bool", "break",
+	"case", "catch", "char", "char16_t", "char32_t", "class", "compl", "const", "constexpr",
+	"const_cast", "continue", "decltype", "default", "delete", "do", "double", "dynamic_cast",
+	"else", "enum", "explicit", "export", "extern", "false", "float", "for", "friend", "goto",
+	"if", "inline", "int", "long", "mutable", "namespace", "new", "noexcept", "not", "not_eq",
+	"nullptr", "operator", "or", "or_eq", "private", "protected", "public", "register",
+	"reinterpret_cast", "return", "short", "signed", "sizeof", "static", "static_assert",
+	"static_cast", "struct", "switch", "template", "this", "thread_local", "throw", "true",
+	"try", "typedef", "typeid", "typename", "union", "unsigned", "using", "virtual", "void",
+	"volatile", "wchar_t", "while", "xor", "xor_eq", "std", "cv"
+};
+
+/* Identifier made from the name of a file, for the generated namespace */
+string code_identifier(const char *filename) {
+	gchar *basename = g_path_get_basename(filename);
+	string identifier;
+
+	for(const char *c = basename; *c != '\0' && *c != '.'; c++) {
+		identifier += g_ascii_isalnum(*c) ? g_ascii_tolower(*c) : '_';
+	}
+
+	g_free(basename);
+
+	bool reserved = false;
+
+	for(size_t i = 0; i < sizeof(CODE_RESERVED_NAMES)/sizeof(CODE_RESERVED_NAMES[0]); i++) {
+		reserved = reserved || identifier == CODE_RESERVED_NAMES[i];
+	}
+
+	if(identifier.empty() || g_ascii_isdigit(identifier[0]) || identifier[0] == '_' || reserved) {
+		identifier = "tuned_" + identifier;
+	}
+
+	return identifier;
+}
+
+/* Writes the rectification maps one after the other, as raw pixels */
+bool write_maps(const char *filename, ChData *data) {
+	FILE *file = fopen(filename, "wb");
+
+	if(file == NULL) {
+		return false;
+	}
+
+	const Mat *maps[] = { &data->map11, &data->map12, &data->map21, &data->map22 };
+	bool success = true;
+
+	for(int i = 0; i < 4; i++) {
+		for(int row = 0; row < maps[i]->rows && success; row++) {
+			success = fwrite(maps[i]->ptr(row), maps[i]->cols*maps[i]->elemSize(), 1, file) == 1;
+		}
+	}
+
+	return fclose(file) == 0 && success;
+}
+
+/* Escapes the characters that would end or break a C++ string literal */
+string escape_c_string(const char *text) {
+	string escaped;
+
+	for(const char *c = text; *c != '\0'; c++) {
+		if(*c == '"' || *c == '\\') {
+			escaped += '\\';
+		}
+
+		escaped += *c;
+	}
+
+	return escaped;
+}
+
+/* Writes a header with the current parameters as constants and a matcher
+ * class allocating everything it needs in its constructor. The maps are
+ * read from maps_filename, or not used at all if it is NULL. */
+void write_code_header(FILE *file, ChData *data, const string &identifier, const char *maps_filename) {
+	bool rectify = maps_filename != NULL;
+	bool use_roi = rectify && data->matcher_type == BM && data->roi1 != NULL && data->roi2 != NULL;
+	const char *matcher_class = data->matcher_type == BM ? "cv::StereoBM" : "cv::StereoSGBM";
+	string guard;
+
+	for(size_t i = 0; i < identifier.size(); i++) {
+		guard += g_ascii_toupper(identifier[i]);
+	}
+
+	guard += "_HPP";
+
+	fprintf(file, "/* Stereo matcher generated by Stereo Tuner for %dx%d images. The parameters\n", data->cv_image_left.cols, data->cv_image_left.rows);
+	fprintf(file, " * are fixed at compile time and every buffer is allocated by the constructor,\n");
+	fprintf(file, " * so compute() neither parses nor allocates. Regenerate it instead of editing. */\n");
+	fprintf(file, "#ifndef %s\n#define %s\n\n", guard.c_str(), guard.c_str());
+	fprintf(file, "#include <opencv2/core.hpp>\n#include <opencv2/calib3d.hpp>\n#include <opencv2/imgproc.hpp>\n#include <cstdio>\n\n");
+	fprintf(file, "namespace %s {\n\n", identifier.c_str());
+
+	fprintf(file, "constexpr int WIDTH = %d;\n", data->cv_image_left.cols);
+	fprintf(file, "constexpr int HEIGHT = %d;\n\n", data->cv_image_left.rows);
+	fprintf(file, "constexpr int BLOCK_SIZE = %d;\n", data->block_size);
+	fprintf(file, "constexpr int MIN_DISPARITY = %d;\n", data->min_disparity);
+	fprintf(file, "constexpr int NUM_DISPARITIES = %d;\n", data->num_disparities);
+	fprintf(file, "constexpr int DISP12_MAX_DIFF = %d;\n", data->disp_12_max_diff);
+	fprintf(file, "constexpr int SPECKLE_RANGE = %d;\n", data->speckle_range);
+	fprintf(file, "constexpr int SPECKLE_WINDOW_SIZE = %d;\n", data->speckle_window_size);
+	fprintf(file, "constexpr int PRE_FILTER_CAP = %d;\n", data->pre_filter_cap);
+	fprintf(file, "constexpr int UNIQUENESS_RATIO = %d;\n", data->uniqueness_ratio);
+
+	if(data->matcher_type == BM) {
+		fprintf(file, "constexpr int PRE_FILTER_SIZE = %d;\n", data->pre_filter_size);
+		fprintf(file, "constexpr int PRE_FILTER_TYPE = %d;\n", data->pre_filter_type);
+		fprintf(file, "constexpr int TEXTURE_THRESHOLD = %d;\n", data->texture_threshold);
+	} else {
+		fprintf(file, "constexpr int P1 = %d;\n", data->p1);
+		fprintf(file, "constexpr int P2 = %d;\n", data->p2);
+		fprintf(file, "constexpr int MODE = %d;\n", data->mode);
+	}
+
+	if(use_roi) {
+		fprintf(file, "\n/* Valid pixels of the rectified images */\n");
+		fprintf(file, "constexpr int ROI1_X = %d, ROI1_Y = %d, ROI1_WIDTH = %d, ROI1_HEIGHT = %d;\n",
+				data->roi1->x, data->roi1->y, data->roi1->width, data->roi1->height);
+		fprintf(file, "constexpr int ROI2_X = %d, ROI2_Y = %d, ROI2_WIDTH = %d, ROI2_HEIGHT = %d;\n",
+				data->roi2->x, data->roi2->y, data->roi2->width, data->roi2->height);
+	}
+
+	if(rectify) {
+		fprintf(file, "\nconstexpr const char *MAPS_FILENAME = \"%s\";\n\n", escape_c_string(maps_filename).c_str());
+		fputs("/* Reads the rectification maps generated with this header: map11 and map21\n"
+				" * are CV_16SC2, map12 and map22 CV_16UC1. Throws cv::Exception on failure. */\n"
+				"inline void read_maps(const char *filename, cv::Mat &map11, cv::Mat &map12, cv::Mat &map21, cv::Mat &map22) {\n"
+				"\tmap11.create(HEIGHT, WIDTH, CV_16SC2);\n"
+				"\tmap12.create(HEIGHT, WIDTH, CV_16UC1);\n"
+				"\tmap21.create(HEIGHT, WIDTH, CV_16SC2);\n"
+				"\tmap22.create(HEIGHT, WIDTH, CV_16UC1);\n\n"
+				"\tcv::Mat *maps[] = { &map11, &map12, &map21, &map22 };\n"
+				"\tstd::FILE *file = std::fopen(filename, \"rb\");\n"
+				"\tbool success = file != NULL;\n\n"
+				"\tfor(int i = 0; i < 4 && success; i++) {\n"
+				"\t\tsuccess = std::fread(maps[i]->data, maps[i]->total()*maps[i]->elemSize(), 1, file) == 1;\n"
+				"\t}\n\n"
+				"\tif(file != NULL) {\n"
+				"\t\tstd::fclose(file);\n"
+				"\t}\n\n"
+				"\tif(!success) {\n"
+				"\t\tCV_Error(cv::Error::StsError, \"Could not read the rectification maps\");\n"
+				"\t}\n"
+				"}\n", file);
+	}
+
+	fprintf(file, "\nclass Matcher {\npublic:\n");
+
+	if(rectify) {
+		fprintf(file, "\t/* Creates the matcher, reads the rectification maps and allocates every buffer */\n");
+		fprintf(file, "\texplicit Matcher(const char *maps_filename = MAPS_FILENAME);\n\n");
+		fprintf(file, "\t/* Undistorts, rectifies and matches 8-bit grayscale WIDTHxHEIGHT images.\n");
+	} else {
+		fprintf(file, "\t/* Creates the matcher and allocates every buffer */\n");
+		fprintf(file, "\tMatcher();\n\n");
+		fprintf(file, "\t/* Matches 8-bit grayscale WIDTHxHEIGHT images.\n");
+	}
+
+	fprintf(file, "\t * Returns the CV_16S disparity multiplied by 16, overwritten by the next call. */\n");
+	fprintf(file, "\tconst cv::Mat &compute(const cv::Mat &left, const cv::Mat &right);\n\n");
+	fprintf(file, "private:\n");
+	fprintf(file, "\tcv::Ptr<%s> matcher;\n", matcher_class);
+
+	if(rectify) {
+		fprintf(file, "\tcv::Mat map11, map12, map21, map22;\n");
+		fprintf(file, "\tcv::Mat rectified_left, rectified_right;\n");
+	}
+
+	fprintf(file, "\tcv::Mat disparity;\n};\n\n");
+
+	if(rectify) {
+		fprintf(file, "inline Matcher::Matcher(const char *maps_filename) :\n");
+		fprintf(file, "\t\trectified_left(HEIGHT, WIDTH, CV_8UC1), rectified_right(HEIGHT, WIDTH, CV_8UC1),\n");
+	} else {
+		fprintf(file, "inline Matcher::Matcher() :\n");
+	}
+
+	fprintf(file, "\t\tdisparity(HEIGHT, WIDTH, CV_16SC1) {\n");
+
+	if(rectify) {
+		fprintf(file, "\tread_maps(maps_filename, map11, map12, map21, map22);\n\n");
+	}
+
+	if(data->matcher_type == BM) {
+		fprintf(file, "\tmatcher = cv::StereoBM::create(NUM_DISPARITIES, BLOCK_SIZE);\n");
+		fprintf(file, "\tmatcher->setMinDisparity(MIN_DISPARITY);\n");
+		fprintf(file, "\tmatcher->setDisp12MaxDiff(DISP12_MAX_DIFF);\n");
+		fprintf(file, "\tmatcher->setSpeckleRange(SPECKLE_RANGE);\n");
+		fprintf(file, "\tmatcher->setSpeckleWindowSize(SPECKLE_WINDOW_SIZE);\n");
+		fprintf(file, "\tmatcher->setPreFilterCap(PRE_FILTER_CAP);\n");
+		fprintf(file, "\tmatcher->setPreFilterSize(PRE_FILTER_SIZE);\n");
+		fprintf(file, "\tmatcher->setPreFilterType(PRE_FILTER_TYPE);\n");
+		fprintf(file, "\tmatcher->setTextureThreshold(TEXTURE_THRESHOLD);\n");
+		fprintf(file, "\tmatcher->setUniquenessRatio(UNIQUENESS_RATIO);\n");
+	} else {
+		fprintf(file, "\tmatcher = cv::StereoSGBM::create(MIN_DISPARITY, NUM_DISPARITIES, BLOCK_SIZE, P1, P2,\n");
+		fprintf(file, "\t\t\tDISP12_MAX_DIFF, PRE_FILTER_CAP, UNIQUENESS_RATIO, SPECKLE_WINDOW_SIZE, SPECKLE_RANGE, MODE);\n");
+	}
+
+	if(use_roi) {
+		fprintf(file, "\tmatcher->setROI1(cv::Rect(ROI1_X, ROI1_Y, ROI1_WIDTH, ROI1_HEIGHT));\n");
+		fprintf(file, "\tmatcher->setROI2(cv::Rect(ROI2_X, ROI2_Y, ROI2_WIDTH, ROI2_HEIGHT));\n");
+	}
+
+	fprintf(file, "\n\t//The first computation allocates the internal buffers of the matcher:\n");
+	fprintf(file, "\tcv::Mat blank(HEIGHT, WIDTH, CV_8UC1, cv::Scalar(0));\n");
+	fprintf(file, "\tmatcher->compute(blank, blank, disparity);\n}\n\n");
+
+	fprintf(file, "inline const cv::Mat &Matcher::compute(const cv::Mat &left, const cv::Mat &right) {\n");
+	fprintf(file, "\tCV_Assert(left.type() == CV_8UC1 && right.type() == CV_8UC1);\n");
+	fprintf(file, "\tCV_Assert(left.cols == WIDTH && left.rows == HEIGHT && right.size() == left.size());\n");
+
+	if(rectify) {
+		fprintf(file, "\tcv::remap(left, rectified_left, map11, map12, cv::INTER_LINEAR);\n");
+		fprintf(file, "\tcv::remap(right, rectified_right, map21, map22, cv::INTER_LINEAR);\n");
+		fprintf(file, "\tmatcher->compute(rectified_left, rectified_right, disparity);\n");
+	} else {
+		fprintf(file, "\tmatcher->compute(left, right, disparity);\n");
+	}
+
+	fprintf(file, "\treturn disparity;\n}\n\n");
+	fprintf(file, "}\n\n#endif\n");
+}
+
+/* Writes a microbenchmark of the generated matcher against the runtime
+ * configured path: parsing the saved parameters into a generic matcher and
+ * letting OpenCV allocate new images on every frame */
+void write_code_benchmark(FILE *file, ChData *data, const string &identifier, const char *header_filename,
+		const char *parameters_filename, bool rectify) {
+	const char *ns = identifier.c_str();
+	bool use_roi = rectify && data->matcher_type == BM && data->roi1 != NULL && data->roi2 != NULL;
+
+	fprintf(file, "/* Compares the matcher of %s with the runtime configured path, reading\n", header_filename);
+	fprintf(file, " * %s into a generic matcher and allocating new images on every frame.\n", parameters_filename);
+	fprintf(file, " * Build and run it from the directory of the generated files:\n");
+	fprintf(file, " *   g++ -O2 -std=c++11 %s_benchmark.cpp -o %s_benchmark `pkg-config --cflags --libs opencv`\n", ns, ns);
+	fprintf(file, " *   ./%s_benchmark left.png right.png [iterations] */\n", ns);
+	fprintf(file, "#include \"%s\"\n", escape_c_string(header_filename).c_str());
+	fputs("#include <opencv2/highgui.hpp>\n"
+			"#include <algorithm>\n"
+			"#include <chrono>\n"
+			"#include <cstdio>\n"
+			"#include <cstdlib>\n"
+			"#include <vector>\n\n"
+			"static double milliseconds_since(std::chrono::steady_clock::time_point start) {\n"
+			"\treturn std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();\n"
+			"}\n\n"
+			"static void print_times(const char *name, double setup, std::vector<double> times) {\n"
+			"\tstd::sort(times.begin(), times.end());\n"
+			"\tstd::printf(\"%-10s %10.3lf %10.3lf %10.3lf %10.3lf\\n\", name, setup, times.front(), times[times.size()/2], times.back());\n"
+			"}\n\n"
+			"int main(int argc, char *argv[]) {\n"
+			"\tif(argc < 3) {\n"
+			"\t\tstd::printf(\"Usage: %s left right [iterations]\\n\", argv[0]);\n"
+			"\t\treturn 1;\n"
+			"\t}\n\n"
+			"\tint iterations = argc > 3 ? std::max(std::atoi(argv[3]), 1) : 100;\n"
+			"\tcv::Mat left = cv::imread(argv[1], cv::IMREAD_GRAYSCALE);\n"
+			"\tcv::Mat right = cv::imread(argv[2], cv::IMREAD_GRAYSCALE);\n\n", file);
+	fprintf(file, "\tif(left.cols != %s::WIDTH || left.rows != %s::HEIGHT || right.size() != left.size()) {\n", ns, ns);
+	fprintf(file, "\t\tstd::printf(\"Could not read two %dx%d images.\\n\");\n", data->cv_image_left.cols, data->cv_image_left.rows);
+	fputs("\t\treturn 1;\n"
+			"\t}\n\n"
+			"\t//Runtime configured path:\n"
+			"\tstd::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();\n", file);
+	fprintf(file, "\tcv::FileStorage fs(\"%s\", cv::FileStorage::READ);\n", escape_c_string(parameters_filename).c_str());
+
+	if(data->matcher_type == BM) {
+		fprintf(file, "\tcv::Ptr<cv::StereoBM> runtime_matcher = cv::StereoBM::create();\n");
+	} else {
+		fprintf(file, "\tcv::Ptr<cv::StereoSGBM> runtime_matcher = cv::StereoSGBM::create(0, 16, 3);\n");
+	}
+
+	fprintf(file, "\truntime_matcher->read(fs.root());\n");
+
+	if(use_roi) {
+		fprintf(file, "\truntime_matcher->setROI1(cv::Rect(%s::ROI1_X, %s::ROI1_Y, %s::ROI1_WIDTH, %s::ROI1_HEIGHT));\n", ns, ns, ns, ns);
+		fprintf(file, "\truntime_matcher->setROI2(cv::Rect(%s::ROI2_X, %s::ROI2_Y, %s::ROI2_WIDTH, %s::ROI2_HEIGHT));\n", ns, ns, ns, ns);
+	}
+
+	if(rectify) {
+		fprintf(file, "\tcv::Mat map11, map12, map21, map22;\n");
+		fprintf(file, "\t%s::read_maps(%s::MAPS_FILENAME, map11, map12, map21, map22);\n", ns, ns);
+	}
+
+	fputs("\tdouble runtime_setup = milliseconds_since(start);\n\n"
+			"\tstd::vector<double> runtime_times;\n"
+			"\tcv::Mat runtime_disparity;\n\n"
+			"\tfor(int i = 0; i < iterations; i++) {\n"
+			"\t\tstart = std::chrono::steady_clock::now();\n", file);
+
+	if(rectify) {
+		fputs("\t\tcv::Mat rectified_left, rectified_right, disparity;\n"
+				"\t\tcv::remap(left, rectified_left, map11, map12, cv::INTER_LINEAR);\n"
+				"\t\tcv::remap(right, rectified_right, map21, map22, cv::INTER_LINEAR);\n"
+				"\t\truntime_matcher->compute(rectified_left, rectified_right, disparity);\n", file);
+	} else {
+		fputs("\t\tcv::Mat disparity;\n"
+				"\t\truntime_matcher->compute(left, right, disparity);\n", file);
+	}
+
+	fputs("\t\truntime_times.push_back(milliseconds_since(start));\n"
+			"\t\truntime_disparity = disparity;\n"
+			"\t}\n\n"
+			"\t//Generated path:\n"
+			"\tstart = std::chrono::steady_clock::now();\n", file);
+	fprintf(file, "\t%s::Matcher matcher;\n", ns);
+	fputs("\tdouble generated_setup = milliseconds_since(start);\n\n"
+			"\tstd::vector<double> generated_times;\n"
+			"\tconst cv::Mat *generated_disparity = NULL;\n\n"
+			"\tfor(int i = 0; i < iterations; i++) {\n"
+			"\t\tstart = std::chrono::steady_clock::now();\n"
+			"\t\tgenerated_disparity = &matcher.compute(left, right);\n"
+			"\t\tgenerated_times.push_back(milliseconds_since(start));\n"
+			"\t}\n\n"
+			"\tbool identical = cv::countNonZero(runtime_disparity != *generated_disparity) == 0;\n\n"
+			"\tstd::printf(\"%-10s %10s %10s %10s %10s\\n\", \"\", \"setup ms\", \"min ms\", \"median ms\", \"max ms\");\n"
+			"\tprint_times(\"runtime\", runtime_setup, runtime_times);\n"
+			"\tprint_times(\"generated\", generated_setup, generated_times);\n"
+			"\tstd::printf(\"The disparities are %s.\\n\", identical ? \"identical\" : \"different\");\n"
+			"\treturn identical ? 0 : 2;\n"
+			"}\n", file);
+}
+
+/* Generates header_filename and, next to it, the rectification maps, the
+ * saved parameters and a microbenchmark, all named after the header.
+ * Returns false if a file could not be written. */
+bool export_code(ChData *data, const char *header_filename) {
+	string base = header_filename;
+	size_t dot = base.rfind('.');
+
+	if(dot != string::npos && base.find('/', dot) == string::npos) {
+		base.erase(dot);
+	}
+
+	string identifier = code_identifier(header_filename);
+	string maps_filename = base + ".maps";
+	string parameters_filename = base + ".yml";
+	string benchmark_filename = base + "_benchmark.cpp";
+	bool rectify = !data->map11.empty();
+
+	//With a rig, export the values the selected pair is matched with, overrides included:
+	if(!data->rig.empty()) {
+		sync_rig_parameters(data);
+		set_parameters(data, data->rig[data->rig_pair].parameters);
+	}
+
+	gchar *header_basename = g_path_get_basename(header_filename);
+	gchar *maps_basename = g_path_get_basename(maps_filename.c_str());
+	gchar *parameters_basename = g_path_get_basename(parameters_filename.c_str());
+	bool success = true;
+
+	if(rectify) {
+		success = write_maps(maps_filename.c_str(), data);
+	}
+
+	FileStorage fs(parameters_filename, FileStorage::WRITE);
+
+	if(success && fs.isOpened()) {
+		write_parameters(fs, data);
+		fs.release();
+	} else {
+		success = false;
+	}
 
-	if(data->pre_filter_type == StereoBM::PREFILTER_NORMALIZED_RESPONSE) {
-		gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(data->rb_pre_filter_normalized),true);
+	FILE *header = success ? fopen(header_filename, "w") : NULL;
+
+	if(header != NULL) {
+		write_code_header(header, data, identifier, rectify ? maps_basename : NULL);
+		success = fclose(header) == 0;
 	} else {
-		gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(data->rb_pre_filter_xsobel),true);
+		success = false;
 	}
 
-	data->live_update = true;
-	update_matcher(data);
+	FILE *benchmark = success ? fopen(benchmark_filename.c_str(), "w") : NULL;
+
+	if(benchmark != NULL) {
+		write_code_benchmark(benchmark, data, identifier, header_basename, parameters_basename, rectify);
+		success = fclose(benchmark) == 0;
+	} else {
+		success = false;
+	}
+
+	g_free(header_basename);
+	g_free(maps_basename);
+	g_free(parameters_basename);
+	return success;
+}
+
+/* Files saved by older versions or by OpenCV itself don't have these */
+void read_hierarchical_parameters(FileStorage &fs, ChData *data) {
+	data->hierarchical = fs["hierarchical"].empty() ? ChData::DEFAULT_HIERARCHICAL : (int) fs["hierarchical"];
+	data->band_height = fs["bandHeight"].empty() ? ChData::DEFAULT_BAND_HEIGHT : (int) fs["bandHeight"];
+	data->band_margin = fs["bandMargin"].empty() ? ChData::DEFAULT_BAND_MARGIN : (int) fs["bandMargin"];
 }
 
 extern "C" {
@@ -484,6 +3538,41 @@ G_MODULE_EXPORT void on_chk_full_dp_clicked(GtkButton *b, ChData *data) {
 	update_matcher(data);
 }
 
+G_MODULE_EXPORT void on_chk_hierarchical_clicked(GtkButton *b, ChData *data) {
+	data->hierarchical = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(b)) ? 1 : 0;
+	gtk_widget_set_sensitive(data->sc_band_height, data->hierarchical != 0);
+	gtk_widget_set_sensitive(data->sc_band_margin, data->hierarchical != 0);
+	update_matcher(data);
+}
+
+G_MODULE_EXPORT void on_adj_band_height_value_changed( GtkAdjustment *adjustment, ChData *data ) {
+	gint value;
+
+	if (data == NULL) {
+		fprintf(stderr,"WARNING: data is null\n");
+		return;
+	}
+
+	value = (gint) gtk_adjustment_get_value( adjustment );
+
+	data->band_height = value;
+	update_matcher(data);
+}
+
+G_MODULE_EXPORT void on_adj_band_margin_value_changed( GtkAdjustment *adjustment, ChData *data ) {
+	gint value;
+
+	if (data == NULL) {
+		fprintf(stderr,"WARNING: data is null\n");
+		return;
+	}
+
+	value = (gint) gtk_adjustment_get_value( adjustment );
+
+	data->band_margin = value;
+	update_matcher(data);
+}
+
 G_MODULE_EXPORT void on_btn_save_clicked(GtkButton *b, ChData *data) {
 	GtkWidget *dialog;
 	GtkFileChooser *chooser;
@@ -517,39 +3606,7 @@ G_MODULE_EXPORT void on_btn_save_clicked(GtkButton *b, ChData *data) {
 		if(!strcmp(filename+len-4,".yml") || !strcmp(filename+len-4,".xml")) {
 			FileStorage fs(filename, FileStorage::WRITE);
 
-			switch(data->matcher_type) {
-			case BM:
-				fs <<
-				"name" << "StereoMatcher.BM" <<
-				"blockSize" << data->block_size <<
-				"minDisparity" << data->min_disparity <<
-				"numDisparities" << data->num_disparities <<
-				"disp12MaxDiff" << data->disp_12_max_diff <<
-				"speckleRange" << data->speckle_range <<
-				"speckleWindowSize" << data->speckle_window_size <<
-				"preFilterCap" << data->pre_filter_cap <<
-				"preFilterSize" << data->pre_filter_size <<
-				"uniquenessRatio" << data->uniqueness_ratio <<
-				"textureThreshold" << data->texture_threshold <<
-				"preFilterType" << data->pre_filter_type;
-				break;
-
-			case SGBM:
-				fs <<
-				"name" << "StereoMatcher.SGBM" <<
-				"blockSize" << data->block_size <<
-				"minDisparity" << data->min_disparity <<
-				"numDisparities" << data->num_disparities <<
-				"disp12MaxDiff" << data->disp_12_max_diff <<
-				"speckleRange" << data->speckle_range <<
-				"speckleWindowSize" << data->speckle_window_size <<
-				"P1" << data->p1 <<
-				"P2" << data->p2 <<
-				"preFilterCap" << data->pre_filter_cap <<
-				"uniquenessRatio" << data->uniqueness_ratio <<
-				"mode" << data->mode;
-				break;
-			}
+			write_parameters(fs, data);
 			fs.release();
 
 			GtkWidget *message = gtk_message_dialog_new(GTK_WINDOW(data->main_window), GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_INFO, GTK_BUTTONS_CLOSE, "Parameters saved successfully");
@@ -613,6 +3670,7 @@ G_MODULE_EXPORT void on_btn_load_clicked(GtkButton *b, ChData *data) {
 					fs["uniquenessRatio"] >> data->uniqueness_ratio;
 					fs["textureThreshold"] >> data->texture_threshold;
 					fs["preFilterType"] >> data->pre_filter_type;
+					read_hierarchical_parameters(fs, data);
 					update_interface(data);
 
 					GtkWidget *message = gtk_message_dialog_new(GTK_WINDOW(data->main_window), GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_ERROR, GTK_BUTTONS_CLOSE, "Parameters loaded successfully.");
@@ -631,6 +3689,7 @@ G_MODULE_EXPORT void on_btn_load_clicked(GtkButton *b, ChData *data) {
 					fs["preFilterCap"] >> data->pre_filter_cap;
 					fs["uniquenessRatio"] >> data->uniqueness_ratio;
 					fs["mode"] >> data->mode;
+					read_hierarchical_parameters(fs, data);
 					update_interface(data);
 
 					GtkWidget *message = gtk_message_dialog_new(GTK_WINDOW(data->main_window), GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_INFO, GTK_BUTTONS_CLOSE, "Parameters loaded successfully.");
@@ -670,7 +3729,272 @@ G_MODULE_EXPORT void on_btn_defaults_clicked(GtkButton *b, ChData *data) {
 	data->p1 = ChData::DEFAULT_P1;
 	data->p2 = ChData::DEFAULT_P2;
 	data->mode = ChData::DEFAULT_MODE;
+	data->hierarchical = ChData::DEFAULT_HIERARCHICAL;
+	data->band_height = ChData::DEFAULT_BAND_HEIGHT;
+	data->band_margin = ChData::DEFAULT_BAND_MARGIN;
+	update_interface(data);
+}
+
+G_MODULE_EXPORT void on_btn_suggest_range_clicked(GtkButton *b, ChData *data) {
+	int first_offset, last_offset;
+	int matches = suggest_disparity_range(data->cv_image_left, data->cv_image_right, first_offset, last_offset);
+
+	if(matches == 0) {
+		GtkWidget *message = gtk_message_dialog_new(GTK_WINDOW(data->main_window), GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_ERROR, GTK_BUTTONS_CLOSE, "Not enough features could be matched between the images.");
+		gtk_dialog_run(GTK_DIALOG(message));
+		gtk_widget_destroy(GTK_WIDGET(message));
+		return;
+	}
+
+	//Keep the range within the sliders, the number of disparities must be divisible by 16:
+	int min_disparity = MAX(first_offset, (int) gtk_adjustment_get_lower(data->adj_min_disparity));
+	min_disparity = MIN(min_disparity, (int) gtk_adjustment_get_upper(data->adj_min_disparity));
+
+	//Swapped images, for instance, give offsets the sliders cannot reach at all:
+	if(last_offset < min_disparity) {
+		GtkWidget *message = gtk_message_dialog_new(GTK_WINDOW(data->main_window), GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_ERROR, GTK_BUTTONS_CLOSE,
+				"The offsets of the matched features, from %d to %d, are outside of the disparity range of the sliders. Are the left and right images swapped?",
+				first_offset, last_offset);
+		gtk_dialog_run(GTK_DIALOG(message));
+		gtk_widget_destroy(GTK_WIDGET(message));
+		return;
+	}
+	int num_disparities = MAX(last_offset - min_disparity + 1, 16);
+	num_disparities = ((num_disparities + 15)/16)*16;
+	num_disparities = MIN(num_disparities, (int) gtk_adjustment_get_upper(data->adj_num_disparities));
+
+	data->min_disparity = min_disparity;
+	data->num_disparities = num_disparities;
 	update_interface(data);
+
+	gchar *status_message = g_strdup_printf("Suggested disparities %d to %d for the offsets of %d matches, between %d and %d",
+			min_disparity, min_disparity + num_disparities - 1, matches, first_offset, last_offset);
+	show_status_message(data, status_message);
+	g_free(status_message);
+}
+
+G_MODULE_EXPORT void on_adj_frame_value_changed(GtkAdjustment *adjustment, ChData *data) {
+	gint frame;
+
+	if (data == NULL || data->timeline == NULL) {
+		return;
+	}
+
+	frame = (gint) gtk_adjustment_get_value(adjustment);
+
+	if(frame == data->current_frame) {
+		return;
+	}
+
+	const DatasetPair &pair = data->timeline->frames[frame];
+	Mat left_image = imread(pair.left_filename, 1);
+	Mat right_image = imread(pair.right_filename, 1);
+
+	if(left_image.empty() || right_image.empty() || left_image.size() != right_image.size()) {
+		fprintf(stderr, "WARNING: could not read frame %s, %s\n",
+				pair.left_filename.c_str(), pair.right_filename.c_str());
+		return;
+	}
+
+	data->current_frame = frame;
+	g_atomic_int_set(&data->timeline->cursor, frame);
+
+	rectify_image(data, left_image, true);
+	rectify_image(data, right_image, false);
+	cvtColor(left_image, data->cv_image_left, CV_BGR2GRAY);
+	cvtColor(right_image, data->cv_image_right, CV_BGR2GRAY);
+	show_image(data->image_left, left_image, data->cv_left_rgb);
+	show_image(data->image_right, right_image, data->cv_right_rgb);
+
+	//Frames not cached yet are computed in the background, starting with this one:
+	gint generation = g_atomic_int_get(&data->timeline->generation);
+
+	if(data->timeline->cache->get(frame, generation, data->cv_image_disparity)) {
+		show_disparity(data);
+	} else {
+		//The disparity of the previous frame must neither be shown nor exported:
+		data->cv_image_disparity.release();
+		gtk_image_clear(data->image_depth);
+		show_status_message(data, "Computing the disparity of this frame...");
+	}
+
+	show_cache_status(data);
+}
+
+/* Shows the predicted runtime for the value under the pointer on the
+ * sliders that drive the cost the most */
+G_MODULE_EXPORT gboolean on_sc_cost_motion_notify_event(GtkWidget *widget, GdkEventMotion *event, ChData *data) {
+	GtkRange *range = GTK_RANGE(widget);
+	GtkAdjustment *adjustment = gtk_range_get_adjustment(range);
+	GdkRectangle rect;
+	gtk_range_get_range_rect(range, &rect);
+
+	if(rect.width <= 0) {
+		return FALSE;
+	}
+
+	double fraction = CLAMP((event->x - rect.x)/rect.width, 0.0, 1.0);
+	int value = (int) (gtk_adjustment_get_lower(adjustment)
+			+ fraction*(gtk_adjustment_get_upper(adjustment) - gtk_adjustment_get_lower(adjustment)));
+	RuntimeFeatures features = runtime_features(data);
+	const char *name;
+
+	//Same rounding as the value-changed handlers:
+	if(widget == data->sc_num_disparities) {
+		value = ((value + 15)/16)*16;
+		features.num_disparities = value;
+		name = "Number of disparities";
+	} else {
+		value |= 1;
+		features.block_size = value;
+		name = "Block size";
+	}
+
+	double predicted;
+
+	if(runtime_model_predict(data->runtime_model, features, predicted)) {
+		gchar *message = g_strdup_printf("%s %d: predicted %.1lf milliseconds%s", name, value, predicted,
+				data->frame_budget > 0 && predicted > data->frame_budget ? ", over the budget" : "");
+		show_status_message(data, message);
+		g_free(message);
+	}
+
+	return FALSE;
+}
+
+G_MODULE_EXPORT gboolean on_sc_cost_leave_notify_event(GtkWidget *widget, GdkEventCrossing *event, ChData *data) {
+	gtk_statusbar_pop(GTK_STATUSBAR(data->status_bar), data->message_status_context);
+	return FALSE;
+}
+
+G_MODULE_EXPORT void on_btn_export_clicked(GtkButton *b, ChData *data) {
+	GtkWidget *dialog;
+	GtkFileChooser *chooser;
+	GtkFileChooserAction action = GTK_FILE_CHOOSER_ACTION_SAVE;
+	gint res;
+
+	if(data->cv_image_disparity.empty()) {
+		GtkWidget *message = gtk_message_dialog_new(GTK_WINDOW(data->main_window), GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_INFO, GTK_BUTTONS_CLOSE, "The disparity of this frame is still being computed.");
+		gtk_dialog_run(GTK_DIALOG(message));
+		gtk_widget_destroy(GTK_WIDGET(message));
+		return;
+	}
+
+	dialog = gtk_file_chooser_dialog_new("Export Disparity", GTK_WINDOW(data->main_window), action, "Cancel", GTK_RESPONSE_CANCEL, "Export", GTK_RESPONSE_ACCEPT, NULL);
+	chooser = GTK_FILE_CHOOSER(dialog);
+	gtk_file_chooser_set_do_overwrite_confirmation(chooser, TRUE);
+	gtk_file_chooser_set_current_name(chooser, "disparity.png");
+
+	GtkFileFilter *filter_png = gtk_file_filter_new();
+	gtk_file_filter_set_name(filter_png,"16-bit PNG (*.png)");
+	gtk_file_filter_add_pattern(filter_png,"*.png");
+
+	GtkFileFilter *filter_disp = gtk_file_filter_new();
+	gtk_file_filter_set_name(filter_disp,"Raw disparity with parameters (*.disp, *.dispz)");
+	gtk_file_filter_add_pattern(filter_disp,"*.disp");
+	gtk_file_filter_add_pattern(filter_disp,"*.dispz");
+
+	gtk_file_chooser_add_filter(chooser,filter_png);
+	gtk_file_chooser_add_filter(chooser,filter_disp);
+
+	res = gtk_dialog_run(GTK_DIALOG(dialog));
+	char *filename;
+	filename = gtk_file_chooser_get_filename(chooser);
+	gtk_widget_destroy(GTK_WIDGET(dialog));
+
+	if(res == GTK_RESPONSE_ACCEPT) {
+		ExportFormat format;
+
+		if(export_format_from_filename(filename, format)) {
+			export_disparity(data, filename, format, true);
+		} else {
+			GtkWidget *message = gtk_message_dialog_new(GTK_WINDOW(data->main_window), GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_ERROR, GTK_BUTTONS_CLOSE, "Currently the only supported formats are PNG, DISP and DISPZ.");
+			gtk_dialog_run(GTK_DIALOG(message));
+			gtk_widget_destroy(GTK_WIDGET(message));
+		}
+
+		g_free(filename);
+	}
+}
+
+G_MODULE_EXPORT void on_btn_export_code_clicked(GtkButton *b, ChData *data) {
+	GtkWidget *dialog;
+	GtkFileChooser *chooser;
+	GtkFileChooserAction action = GTK_FILE_CHOOSER_ACTION_SAVE;
+	gint res;
+
+	if(data->hierarchical) {
+		GtkWidget *message = gtk_message_dialog_new(GTK_WINDOW(data->main_window), GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_ERROR, GTK_BUTTONS_CLOSE, "Hierarchical matching cannot be exported to C++ yet.");
+		gtk_dialog_run(GTK_DIALOG(message));
+		gtk_widget_destroy(GTK_WIDGET(message));
+		return;
+	}
+
+	dialog = gtk_file_chooser_dialog_new("Export C++", GTK_WINDOW(data->main_window), action, "Cancel", GTK_RESPONSE_CANCEL, "Export", GTK_RESPONSE_ACCEPT, NULL);
+	chooser = GTK_FILE_CHOOSER(dialog);
+	gtk_file_chooser_set_do_overwrite_confirmation(chooser, TRUE);
+	gtk_file_chooser_set_current_name(chooser, "tuned_matcher.hpp");
+
+	GtkFileFilter *filter = gtk_file_filter_new();
+	gtk_file_filter_set_name(filter,"C++ header (*.hpp, *.h)");
+	gtk_file_filter_add_pattern(filter,"*.hpp");
+	gtk_file_filter_add_pattern(filter,"*.h");
+	gtk_file_chooser_add_filter(chooser,filter);
+
+	res = gtk_dialog_run(GTK_DIALOG(dialog));
+	char *filename;
+	filename = gtk_file_chooser_get_filename(chooser);
+	gtk_widget_destroy(GTK_WIDGET(dialog));
+
+	if(res == GTK_RESPONSE_ACCEPT) {
+		GtkWidget *message;
+
+		if(export_code(data, filename)) {
+			message = gtk_message_dialog_new(GTK_WINDOW(data->main_window), GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_INFO, GTK_BUTTONS_CLOSE, "C++ matcher and microbenchmark generated successfully");
+		} else {
+			message = gtk_message_dialog_new(GTK_WINDOW(data->main_window), GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_ERROR, GTK_BUTTONS_CLOSE, "Could not write the generated files.");
+		}
+
+		gtk_dialog_run(GTK_DIALOG(message));
+		gtk_widget_destroy(GTK_WIDGET(message));
+		g_free(filename);
+	}
+}
+
+G_MODULE_EXPORT void on_nb_rig_switch_page(GtkNotebook *notebook, GtkWidget *page, guint page_num, ChData *data) {
+	if (data == NULL) {
+		fprintf(stderr, "WARNING: data is null\n");
+		return;
+	}
+
+	if(page_num >= data->rig.size()) {
+		return;
+	}
+
+	//The interface shows the values of the selected pair:
+	use_rig_pair(data, page_num);
+	show_parameters(data);
+	show_image(data->image_left, data->rig[page_num].left_image, data->cv_left_rgb);
+	show_image(data->image_right, data->rig[page_num].right_image, data->cv_right_rgb);
+
+	if(!data->cv_image_disparity.empty()) {
+		show_disparity(data);
+	}
+
+	RigPair &pair = data->rig[page_num];
+	string overrides = describe_overrides(pair);
+	gchar *status_message;
+
+	if(overrides.empty()) {
+		status_message = g_strdup_printf("%s uses the shared parameters, changes apply to every pair without own values",
+				pair.name.c_str());
+	} else {
+		status_message = g_strdup_printf("%s has its own values for %s, changes to them only apply to this pair",
+				pair.name.c_str(), overrides.c_str());
+	}
+
+	show_status_message(data, status_message);
+	g_free(status_message);
 }
 }
 
@@ -681,6 +4005,24 @@ int main(int argc, char *argv[]) {
 	char *right_filename = default_right_filename;
 	char *extrinsics_filename = NULL;
 	char *intrinsics_filename = NULL;
+	char *dataset_directory = NULL;
+	char *sequence_directory = NULL;
+	vector<DatasetPair> sequence_frames;
+	int prefetch_depth = DatasetEvaluator::DEFAULT_PREFETCH_DEPTH;
+	int dataset_cache = DatasetEvaluator::DEFAULT_CACHE_MEGABYTES;
+	char *record_filename = NULL;
+	char *replay_filename = NULL;
+	double replay_tolerance = -1;
+	int export_capacity = DisparityExporter::DEFAULT_CAPACITY;
+	char *export_directory = NULL;
+	char *export_format_name = NULL;
+	double frame_budget = 0;
+	double max_runtime = 0;
+	bool pair_given = false;
+	vector<DatasetPair> dataset_pairs;
+	char *rig_filename = NULL;
+	vector<RigPair> rig_pairs;
+	bool instrument = false;
 
 	GtkBuilder *builder;
 	GError *error = NULL;
@@ -693,35 +4035,135 @@ int main(int argc, char *argv[]) {
 		if (strcmp(argv[i], "-left") == 0) {
 			i++;
 			left_filename = argv[i];
+			pair_given = true;
 		} else if (strcmp(argv[i], "-right") == 0) {
 			i++;
 			right_filename = argv[i];
+			pair_given = true;
 		} else if (strcmp(argv[i], "-extrinsics") == 0) {
 			i++;
 			extrinsics_filename = argv[i];
 		} else if (strcmp(argv[i], "-intrinsics") == 0) {
 			i++;
 			intrinsics_filename = argv[i];
+		} else if (strcmp(argv[i], "-dataset") == 0) {
+			i++;
+			dataset_directory = argv[i];
+		} else if (strcmp(argv[i], "-sequence") == 0) {
+			i++;
+			sequence_directory = argv[i];
+		} else if (strcmp(argv[i], "-prefetch") == 0) {
+			i++;
+			prefetch_depth = atoi(argv[i]);
+		} else if (strcmp(argv[i], "-dataset_cache") == 0) {
+			i++;
+			dataset_cache = atoi(argv[i]);
+		} else if (strcmp(argv[i], "-record") == 0) {
+			i++;
+			record_filename = argv[i];
+		} else if (strcmp(argv[i], "-replay") == 0) {
+			i++;
+			replay_filename = argv[i];
+		} else if (strcmp(argv[i], "-tolerance") == 0) {
+			i++;
+			replay_tolerance = atof(argv[i]);
+		} else if (strcmp(argv[i], "-export") == 0) {
+			i++;
+			export_directory = argv[i];
+		} else if (strcmp(argv[i], "-export_format") == 0) {
+			i++;
+			export_format_name = argv[i];
+		} else if (strcmp(argv[i], "-budget") == 0) {
+			i++;
+			frame_budget = atof(argv[i]);
+		} else if (strcmp(argv[i], "-max_runtime") == 0) {
+			i++;
+			max_runtime = atof(argv[i]);
+		} else if (strcmp(argv[i], "-export_queue") == 0) {
+			i++;
+			export_capacity = atoi(argv[i]);
+		} else if (strcmp(argv[i], "-rig") == 0) {
+			i++;
+			rig_filename = argv[i];
+		} else if (strcmp(argv[i], "-instrument") == 0) {
+			instrument = true;
 		}
 	}
 
-	Mat left_image = imread(left_filename,1);
+	if(dataset_directory != NULL) {
+		dataset_pairs = scan_dataset(dataset_directory);
 
-	if(left_image.empty()) {
-		printf("Could not read left image %s.\n",left_filename);
-		exit(1);
+		if(dataset_pairs.empty()) {
+			printf("Could not find any stereo pair in dataset %s.\n", dataset_directory);
+			exit(1);
+		}
+
+		printf("Evaluating %d stereo pairs from dataset %s.\n", (int) dataset_pairs.size(), dataset_directory);
+
+		//Tune on the first pair unless we were told otherwise:
+		if(!pair_given) {
+			left_filename = (char*) dataset_pairs[0].left_filename.c_str();
+			right_filename = (char*) dataset_pairs[0].right_filename.c_str();
+		}
 	}
 
-	Mat right_image = imread(right_filename,1);
+	if(sequence_directory != NULL) {
+		//A dataset directory can be browsed as a sequence too:
+		if(!scan_sequence(sequence_directory, sequence_frames)) {
+			sequence_frames = scan_dataset(sequence_directory);
+		}
 
-	if(right_image.empty()) {
-		printf("Could not read right image %s.\n",right_filename);
-		exit(1);
+		if(sequence_frames.empty()) {
+			printf("Could not find any stereo pair in sequence %s.\n", sequence_directory);
+			exit(1);
+		}
+
+		if(pair_given) {
+			printf("Ignoring -left and -right, the frames of sequence %s are used instead.\n", sequence_directory);
+		}
+
+		left_filename = (char*) sequence_frames[0].left_filename.c_str();
+		right_filename = (char*) sequence_frames[0].right_filename.c_str();
 	}
 
-	if(left_image.size() != right_image.size()) {
-		printf("Left and right images have different sizes.\n");
-		exit(1);
+	if(rig_filename != NULL) {
+		//A session step times the whole rig, which a replay on a single pair could not compare with:
+		if(dataset_directory != NULL || sequence_directory != NULL || record_filename != NULL || replay_filename != NULL) {
+			printf("A rig cannot be combined with -dataset, -sequence, -record or -replay.\n");
+			exit(1);
+		}
+
+		if(!load_rig(rig_filename, rig_pairs)) {
+			exit(1);
+		}
+
+		printf("Tuning %d stereo pairs from rig %s.\n", (int) rig_pairs.size(), rig_filename);
+	}
+
+	Mat left_image, right_image;
+
+	if(!rig_pairs.empty()) {
+		left_image = rig_pairs[0].left_image;
+		right_image = rig_pairs[0].right_image;
+	} else {
+		left_image = imread(left_filename,1);
+
+		if(left_image.empty()) {
+			printf("Could not read left image %s.\n",left_filename);
+			exit(1);
+		}
+
+		right_image = imread(right_filename,1);
+
+		if(right_image.empty()) {
+			printf("Could not read right image %s.\n",right_filename);
+			exit(1);
+		}
+
+		if(left_image.size() != right_image.size()) {
+			printf("Left and right images have different sizes.\n");
+			exit(1);
+		}
 	}
 
 	Mat gray_left, gray_right;
@@ -730,58 +4172,81 @@ int main(int argc, char *argv[]) {
 
 	/* Create data */
 	data = new ChData();
+	data->frame_budget = frame_budget;
+	data->max_runtime = max_runtime;
+	data->instrument = instrument;
 
-	if(intrinsics_filename != NULL && extrinsics_filename != NULL) {
-		FileStorage intrinsicsFs(intrinsics_filename,FileStorage::READ);
+	if(instrument) {
+		start_instrumentation();
+	}
+
+	if(!rig_pairs.empty()) {
+		//The images of each pair were already rectified:
+		data->rig.swap(rig_pairs);
+		data->rig_shared = get_parameters(data);
+		share_rig_parameters(data);
+		use_rig_pair(data, 0);
+	} else if(intrinsics_filename != NULL && extrinsics_filename != NULL) {
+		Rectification rectification;
 
-		if(!intrinsicsFs.isOpened()) {
-			printf("Could not open intrinsic parameters file %s.\n", intrinsics_filename);
+		if(!load_rectification(intrinsics_filename, extrinsics_filename, left_image.size(), rectification)) {
 			exit(1);
 		}
 
-		Mat m1, d1, m2, d2;
-		intrinsicsFs["M1"] >> m1;
-		intrinsicsFs["D1"] >> d1;
-		intrinsicsFs["M2"] >> m2;
-		intrinsicsFs["D2"] >> d2;
+		printf("Using provided calibration files to undistort and rectify images.\n");
 
-		FileStorage extrinsicsFs(extrinsics_filename,FileStorage::READ);
+		data->roi1 = new Rect(rectification.roi1);
+		data->roi2 = new Rect(rectification.roi2);
+		data->q = rectification.q;
+		data->map11 = rectification.map11;
+		data->map12 = rectification.map12;
+		data->map21 = rectification.map21;
+		data->map22 = rectification.map22;
 
-		if(!extrinsicsFs.isOpened()) {
-			printf("Could not open extrinsic parameters file %s.\n", extrinsics_filename);
-			exit(1);
-		}
+		data->cv_image_left = gray_left;
+		data->cv_image_right = gray_right;
+		rectify_image(data, data->cv_image_left, true);
+		rectify_image(data, data->cv_image_right, false);
+		rectify_image(data, left_image, true);
+		rectify_image(data, right_image, false);
+	} else {
+		data->cv_image_left = gray_left;
+		data->cv_image_right = gray_right;
+	}
 
-		printf("Using provided calibration files to undistort and rectify images.\n");
+	SessionInputs session_inputs;
+	session_inputs.left = left_filename;
+	session_inputs.right = right_filename;
+	session_inputs.intrinsics = intrinsics_filename;
+	session_inputs.extrinsics = extrinsics_filename;
 
-		Mat r,t;
-		extrinsicsFs["R"] >> r;
-		extrinsicsFs["T"] >> t;
+	/* Replay a session without the interface */
+	if(replay_filename != NULL) {
+		return session_replay(data, replay_filename, session_inputs, replay_tolerance);
+	}
 
-		Mat r1,p1,r2,p2,q;
-		data->roi1 = new Rect();
-		data->roi2 = new Rect();
-		stereoRectify(m1,d1,m2,d2,left_image.size(),r,t,r1,r2,p1,p2,q,CALIB_ZERO_DISPARITY,-1,left_image.size(),data->roi1,data->roi2);
+	if(record_filename != NULL && !session_open(data, record_filename, session_inputs)) {
+		printf("Could not open session log %s.\n", record_filename);
+		exit(1);
+	}
 
-		Mat map11, map12, map21, map22;
-		initUndistortRectifyMap(m1, d1, r1, p1, left_image.size(), CV_16SC2, map11, map12);
-		initUndistortRectifyMap(m2, d2, r2, p2, right_image.size(), CV_16SC2, map21, map22);
+	data->exporter = disparity_exporter_new(export_capacity);
 
-		Mat remapped_left, remapped_right;
-		remap(gray_left, remapped_left, map11, map12, INTER_LINEAR);
-		remap(gray_right, remapped_right, map21, map22, INTER_LINEAR);
+	if(export_directory != NULL) {
+		if(g_mkdir_with_parents(export_directory, 0755) != 0) {
+			printf("Could not create export directory %s.\n", export_directory);
+			exit(1);
+		}
 
-		data->cv_image_left = remapped_left;
-		data->cv_image_right = remapped_right;
+		gchar *format_filename = g_strdup_printf("disparity.%s", export_format_name != NULL ? export_format_name : "png");
 
-		Mat color_remapped_left, color_remapped_right;
-		remap(left_image, color_remapped_left, map11, map12, INTER_LINEAR);
-		remap(right_image, color_remapped_right, map21, map22, INTER_LINEAR);
-		left_image = color_remapped_left;
-		right_image = color_remapped_right;
-	} else {
-		data->cv_image_left = gray_left;
-		data->cv_image_right = gray_right;
+		if(!export_format_from_filename(format_filename, data->export_format)) {
+			printf("Unknown export format %s, use png, disp or dispz.\n", export_format_name);
+			exit(1);
+		}
+
+		g_free(format_filename);
+		data->export_directory = export_directory;
 	}
 
 	/* Init GTK+ */
@@ -819,6 +4284,9 @@ int main(int argc, char *argv[]) {
 	data->rb_pre_filter_normalized = GTK_WIDGET(gtk_builder_get_object(builder, "rb_pre_filter_normalized"));
 	data->rb_pre_filter_xsobel = GTK_WIDGET(gtk_builder_get_object(builder, "rb_pre_filter_xsobel"));
 	data->chk_full_dp = GTK_WIDGET(gtk_builder_get_object(builder, "chk_full_dp"));
+	data->chk_hierarchical = GTK_WIDGET(gtk_builder_get_object(builder, "chk_hierarchical"));
+	data->sc_band_height = GTK_WIDGET(gtk_builder_get_object(builder, "sc_band_height"));
+	data->sc_band_margin = GTK_WIDGET(gtk_builder_get_object(builder, "sc_band_margin"));
 	data->status_bar = GTK_WIDGET(gtk_builder_get_object(builder, "status_bar"));
 	data->rb_bm = GTK_WIDGET(gtk_builder_get_object(builder, "algo_sbm"));
 	data->rb_sgbm = GTK_WIDGET(gtk_builder_get_object(builder, "algo_ssgbm"));
@@ -834,30 +4302,51 @@ int main(int argc, char *argv[]) {
 	data->adj_pre_filter_size = GTK_ADJUSTMENT(gtk_builder_get_object(builder, "adj_pre_filter_size"));
 	data->adj_uniqueness_ratio = GTK_ADJUSTMENT(gtk_builder_get_object(builder, "adj_uniqueness_ratio"));
 	data->adj_texture_threshold = GTK_ADJUSTMENT(gtk_builder_get_object(builder, "adj_texture_threshold"));
+	data->adj_band_height = GTK_ADJUSTMENT(gtk_builder_get_object(builder, "adj_band_height"));
+	data->adj_band_margin = GTK_ADJUSTMENT(gtk_builder_get_object(builder, "adj_band_margin"));
 	data->status_bar_context = gtk_statusbar_get_context_id(GTK_STATUSBAR(data->status_bar), "Statusbar context");
+	data->lbl_dataset = GTK_LABEL(gtk_builder_get_object(builder, "lbl_dataset"));
+	data->message_status_context = gtk_statusbar_get_context_id(GTK_STATUSBAR(data->status_bar), "Message context");
+	data->box_timeline = GTK_WIDGET(gtk_builder_get_object(builder, "box_timeline"));
+	data->adj_frame = GTK_ADJUSTMENT(gtk_builder_get_object(builder, "adj_frame"));
+	data->lbl_cache = GTK_LABEL(gtk_builder_get_object(builder, "lbl_cache"));
+	data->nb_rig = GTK_NOTEBOOK(gtk_builder_get_object(builder, "nb_rig"));
+
+	//One page per pair, before the signals are connected so switching to the first one is not handled:
+	for(size_t p = 0; p < data->rig.size(); p++) {
+		GtkWidget *page = gtk_label_new(data->rig[p].name.c_str());
+		gtk_notebook_append_page(data->nb_rig, page, gtk_label_new(data->rig[p].name.c_str()));
+		data->rig[p].label = GTK_LABEL(page);
+	}
+
+	if(!data->rig.empty()) {
+		gtk_widget_show_all(GTK_WIDGET(data->nb_rig));
+		show_parameters(data);
+	}
+
+	if(!sequence_frames.empty()) {
+		data->timeline = timeline_new(data, sequence_frames);
+
+		if(!data->timeline->cache->is_open()) {
+			printf("Could not create the disparity cache.\n");
+			exit(1);
+		}
+
+		gtk_adjustment_set_upper(data->adj_frame, sequence_frames.size() - 1);
+		gtk_widget_show(data->box_timeline);
+	}
+
+	if(!dataset_pairs.empty()) {
+		data->dataset = dataset_evaluator_new(data, dataset_pairs, prefetch_depth, dataset_cache);
+		gtk_widget_show(GTK_WIDGET(data->lbl_dataset));
+	}
 
 	//Put images in place:
 	//gtk_image_set_from_file(data->image_left, left_filename);
 	//gtk_image_set_from_file(data->image_right, right_filename);
 
-	Mat leftRGB, rightRGB;
-	cvtColor(left_image, leftRGB,
-			CV_BGR2RGB);
-	GdkPixbuf *pixbuf = gdk_pixbuf_new_from_data(
-			(guchar*) leftRGB.data, GDK_COLORSPACE_RGB, false,
-			8, leftRGB.cols,
-			leftRGB.rows, leftRGB.step,
-			NULL, NULL);
-	gtk_image_set_from_pixbuf(data->image_left, pixbuf);
-
-	cvtColor(right_image, rightRGB,
-			CV_BGR2RGB);
-	pixbuf = gdk_pixbuf_new_from_data(
-			(guchar*) rightRGB.data, GDK_COLORSPACE_RGB, false,
-			8, rightRGB.cols,
-			rightRGB.rows, rightRGB.step,
-			NULL, NULL);
-	gtk_image_set_from_pixbuf(data->image_right, pixbuf);
+	show_image(data->image_left, left_image, data->cv_left_rgb);
+	show_image(data->image_right, right_image, data->cv_right_rgb);
 
 	update_matcher(data);
 
@@ -873,5 +4362,19 @@ int main(int argc, char *argv[]) {
 	/* Start main loop */
 	gtk_main();
 
+	if(data->dataset != NULL) {
+		dataset_evaluator_free(data->dataset);
+	}
+
+	if(data->timeline != NULL) {
+		timeline_free(data->timeline);
+	}
+
+	if(data->session_log != NULL) {
+		fclose(data->session_log);
+	}
+
+	disparity_exporter_free(data->exporter);
+
 	return (0);
 }